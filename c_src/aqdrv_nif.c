@@ -1,5 +1,7 @@
 #define _TESTDBG_
 #include "aqdrv_nif.h"
+#include "xxhash.h"
+#include <dirent.h>
 
 #ifdef _WIN32
 #define __thread __declspec( thread )
@@ -19,9 +21,37 @@ ERL_NIF_TERM atom_compr;
 ERL_NIF_TERM atom_tcpfail;
 ERL_NIF_TERM atom_drivername;
 ERL_NIF_TERM atom_again;
+ERL_NIF_TERM atom_wait;
+ERL_NIF_TERM atom_hwm;
+ERL_NIF_TERM atom_notify;
 ERL_NIF_TERM atom_schedulers;
 ERL_NIF_TERM atom_recycle;
+ERL_NIF_TERM atom_rings;
+ERL_NIF_TERM atom_retention;
+ERL_NIF_TERM atom_maxbytes;
+ERL_NIF_TERM atom_maxage;
+ERL_NIF_TERM atom_minindex;
+ERL_NIF_TERM atom_prealloc;
+ERL_NIF_TERM atom_prezero;
+ERL_NIF_TERM atom_wmode;
+ERL_NIF_TERM atom_direct;
+ERL_NIF_TERM atom_pwrite;
+ERL_NIF_TERM atom_mmap;
+ERL_NIF_TERM atom_dalign;
+ERL_NIF_TERM atom_filelimit;
+ERL_NIF_TERM atom_align;
+ERL_NIF_TERM atom_prefault;
+ERL_NIF_TERM atom_handles;
+ERL_NIF_TERM atom_striping;
+ERL_NIF_TERM atom_timeindex;
+ERL_NIF_TERM atom_timeindexmb;
+ERL_NIF_TERM atom_cpus;
+ERL_NIF_TERM atom_numa;
+ERL_NIF_TERM atom_exclude;
+ERL_NIF_TERM atom_iorate;
+ERL_NIF_TERM atom_iops;
 ErlNifResourceType *connection_type;
+ErlNifResourceType *segment_type;
 
 FILE *g_log = NULL;
 
@@ -31,6 +61,14 @@ static const LZ4F_preferences_t lz4Prefs = {
 	0,   /* autoflush */
 	{ 0, 0, 0, 0 },  /* reserved, must be set to 0 */
 };
+// Record trailer already covers compressed bytes, or data is verified upstream.
+static const LZ4F_preferences_t lz4PrefsNoCheck = {
+	{ LZ4F_max64KB, LZ4F_blockIndependent, LZ4F_noContentChecksum, LZ4F_frame, 0, { 0, 0 } },
+	0,   /* compression level */
+	0,   /* autoflush */
+	{ 0, 0, 0, 0 },  /* reserved, must be set to 0 */
+};
+#define CON_PREFS(C) ((C)->integrity == integrity_lz4 ? &lz4Prefs : &lz4PrefsNoCheck)
 
 static void destruct_connection(ErlNifEnv *env, void *arg)
 {
@@ -41,6 +79,7 @@ static void destruct_connection(ErlNifEnv *env, void *arg)
 	LZ4F_freeCompressionContext(r->map.cctx);
 	LZ4F_freeCompressionContext(r->data.cctx);
 	enif_free_env(r->env);
+	free(r->pathWrites);
 	free(r->map.buf);
 	free(r->data.buf);
 	free(r->packetPrefix);
@@ -48,21 +87,38 @@ static void destruct_connection(ErlNifEnv *env, void *arg)
 }
 
 
+// Read reference to a segment, binaries returned by read_range point into its map.
+typedef struct segref
+{
+	qfile *f;
+} segref;
+
+static void destruct_segment(ErlNifEnv *env, void *arg)
+{
+	segref *r = (segref*)arg;
+	file_release(r->f);
+}
 
 static ERL_NIF_TERM make_error_tuple(ErlNifEnv *env, const char *reason)
 {
 	return enif_make_tuple2(env, atom_error, enif_make_string(env, reason, ERL_NIF_LATIN1));
 }
 
+static queue* command_queue(int thread, int syncThread, priv_data *p)
+{
+	if (syncThread == -1)
+		return p->tasks[thread];
+	else
+		return p->syncTasks[syncThread];
+}
+
+// Returns NULL if there are no free items or our ring to the thread is full.
 static qitem* command_create(int thread, int syncThread, priv_data *p)
 {
-	// queue *thrCmds = NULL;
 	qitem *item;
 
-	// if (syncThread == -1)
-	// 	thrCmds = p->tasks[thread];
-	// else
-	// 	thrCmds = p->syncTasks[syncThread];
+	if (queue_full(command_queue(thread, syncThread, p)))
+		return NULL;
 
 	item = queue_get_item();
 	if (!item)
@@ -76,13 +132,35 @@ static qitem* command_create(int thread, int syncThread, priv_data *p)
 	return item;
 }
 
+// Same as command_create, but if no items are available, caller is registered
+// to receive {aqdrv_wake, Ref} once one is recycled and answer is set to wait.
+// If that is not possible answer is set to again.
+static qitem* command_create_wait(int thread, int syncThread, priv_data *p,
+	ErlNifEnv *env, ErlNifPid *pid, ERL_NIF_TERM ref, ERL_NIF_TERM *answer)
+{
+	qitem *item;
+	while ((item = command_create(thread, syncThread, p)) == NULL)
+	{
+		int rc = queue_wait_item(pid, env, ref, command_queue(thread, syncThread, p));
+		if (rc > 0)
+		{
+			DBG("Returning wait!");
+			*answer = atom_wait;
+			return NULL;
+		}
+		else if (rc < 0)
+		{
+			DBG("Returning again!");
+			*answer = atom_again;
+			return NULL;
+		}
+	}
+	return item;
+}
+
 static ERL_NIF_TERM push_command(int thread, int syncThread, priv_data *pd, qitem *item)
 {
-	queue *thrCmds = NULL;
-	if (syncThread == -1)
-		thrCmds = pd->tasks[thread];
-	else
-		thrCmds = pd->syncTasks[syncThread];
+	queue *thrCmds = command_queue(thread, syncThread, pd);
 	if(!queue_push(thrCmds, item))
 	{
 		return make_error_tuple(item->env, "command_push_failed");
@@ -139,16 +217,19 @@ static ERL_NIF_TERM q_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 	u32 thread;
 	coninf *con;
 	u32 compr;
+	u32 integrity = integrity_record;
 	ERL_NIF_TERM resTerm;
 	priv_data *pd = (priv_data*)enif_priv_data(env);
 
-	if (argc != 2)
+	if (argc < 2)
 		return make_error_tuple(env, "integer hash required");
 
 	if (!enif_get_uint(env, argv[0], &thread))
 		return make_error_tuple(env, "integer hash required");
 	if (!enif_get_uint(env, argv[1], &compr))
 		return make_error_tuple(env, "integer compr flag required");
+	if (argc > 2 && (!enif_get_uint(env, argv[2], &integrity) || integrity > integrity_none))
+		return make_error_tuple(env, "invalid integrity mode");
 
 	con = enif_alloc_resource(connection_type, sizeof(coninf));
 	if (!con)
@@ -158,6 +239,7 @@ static ERL_NIF_TERM q_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 	memset(con,0,sizeof(coninf));
 	con->thread = ((thread % pd->nPaths) * pd->nThreads) + (thread % pd->nThreads);
 	con->doCompr = compr;
+	con->integrity = integrity;
 	if (con->doCompr)
 	{
 		con->data.buf = calloc(1,PGSZ);
@@ -174,14 +256,41 @@ static ERL_NIF_TERM q_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 	con->map.bufSize = PGSZ;
 	con->map.buf = calloc(1,PGSZ);
 	con->header = calloc(1,HDRMAX);
+	con->pathWrites = calloc(pd->nPaths, sizeof(conpath));
 	con->env = enif_alloc_env();
 	LZ4F_createCompressionContext(&con->data.cctx, LZ4F_VERSION);
 	LZ4F_createCompressionContext(&con->map.cctx, LZ4F_VERSION);
-	LZ4F_createDecompressionContext(&con->dctx, LZ4F_VERSION);
 
 	return enif_make_tuple2(env, enif_make_atom(env,"aqdrv"), resTerm);
 }
 
+// Record checksum over data frame is computed as data is staged, so submit does
+// not hash the whole record. First 8 bytes of frame are only final at flush,
+// add_trailer hashes them with header and map.
+static void hash_data(coninf *con, const u8 *p, u32 len)
+{
+	if (con->integrity != integrity_record)
+		return;
+	if (!con->dataHashed)
+	{
+		XXH64_reset(&con->dataHash, 0);
+		con->dataHashed = 8;
+	}
+	if (len)
+		XXH64_update(&con->dataHash, p, len);
+}
+
+// Compressed output in buf that is not in dataHash yet.
+static void hash_compressed(coninf *con, lz4buf *buf)
+{
+	hash_data(con, NULL, 0);
+	if (con->integrity == integrity_record && buf->writeSize > con->dataHashed)
+	{
+		XXH64_update(&con->dataHash, buf->buf + con->dataHashed, buf->writeSize - con->dataHashed);
+		con->dataHashed = buf->writeSize;
+	}
+}
+
 static u32 add_iov_bin(coninf *con, lz4buf *buf, ErlNifBinary bin)
 {
 	if (!con->started)
@@ -196,6 +305,7 @@ static u32 add_iov_bin(coninf *con, lz4buf *buf, ErlNifBinary bin)
 	}
 	IOV_SET(buf->iov[buf->iovUsed], bin.data, bin.size);
 	buf->iovUsed++;
+	hash_data(con, bin.data, bin.size);
 
 	buf->writeSize += bin.size;
 	buf->uncomprSz += bin.size;
@@ -207,7 +317,7 @@ static u32 add_compr_bin(coninf *con, lz4buf *buf, ErlNifBinary bin, u32 offset)
 {
 	u32 toWrite = MIN(64*1024, bin.size - offset);
 	size_t bWritten = 0;
-	size_t szNeed = LZ4F_compressBound(toWrite, &lz4Prefs);
+	size_t szNeed = LZ4F_compressBound(toWrite, CON_PREFS(con));
 
 	if (szNeed > buf->bufSize - buf->writeSize)
 	{
@@ -218,7 +328,7 @@ static u32 add_compr_bin(coninf *con, lz4buf *buf, ErlNifBinary bin, u32 offset)
 	if (!con->started)
 	{
 		DBG("Frame begin");
-		bWritten = LZ4F_compressBegin(buf->cctx, buf->buf, buf->bufSize, &lz4Prefs);
+		bWritten = LZ4F_compressBegin(buf->cctx, buf->buf, buf->bufSize, CON_PREFS(con));
 		if (LZ4F_isError(bWritten))
 		{
 			DBG("Can not write begin");
@@ -245,13 +355,48 @@ static u32 add_compr_bin(coninf *con, lz4buf *buf, ErlNifBinary bin, u32 offset)
 	}
 
 	buf->writeSize += bWritten;
-	buf->uncomprSz += bin.size;
+	buf->uncomprSz += toWrite;
+	hash_compressed(con, buf);
 
 	DBG("Wrote ws=%u, offset=%u, toWrite=%u, bufsize=%u",buf->writeSize, offset, toWrite, buf->bufSize);
 
 	return toWrite;
 }
 
+// Append an entry to map frame.
+static void stage_map_entry(coninf *res, ErlNifBinary *name, u8 type, u32 dataSize)
+{
+	lz4buf *buf = &res->map;
+	u32 pos;
+
+	if (buf->writeSize == 0)
+	{
+		writeUint32LE(buf->buf, 0x184D2A50);
+		buf->writeSize = 8;
+	}
+
+	while ((name->size+2*4+3) > buf->bufSize - buf->writeSize)
+	{
+		buf->bufSize *= 1.5;
+		buf->buf = realloc(buf->buf, buf->bufSize);
+	}
+	pos = buf->writeSize;
+
+	// <<EntireLen, SizeName, Name:SizeName/binary, 
+	//   DataType, Size:32/unsigned,UncompressedOffset:32/unsigned>>
+	buf->buf[pos++] = name->size+2*4+2;
+	buf->buf[pos++] = (u8)name->size;
+	memcpy(buf->buf+pos, name->data, name->size);
+	pos += name->size;
+	buf->buf[pos++] = type;
+	writeUint32(buf->buf+pos, dataSize);
+	pos += 4;
+	writeUint32(buf->buf+pos, res->data.uncomprSz);
+
+	buf->writeSize += name->size+2*4+3;
+	buf->uncomprSz += name->size+2*4+3;
+}
+
 // Call before q_stage
 // arg0 - con
 // arg1 - name
@@ -263,8 +408,6 @@ static ERL_NIF_TERM q_stage_map(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
 	int type;
 	coninf *res = NULL;
 	u32 dataSize;
-	u8 pos = 0;
-	lz4buf *buf;
 
 	if (argc != 4)
 		return atom_false;
@@ -283,36 +426,48 @@ static ERL_NIF_TERM q_stage_map(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
 
 	DBG("stage_map");
 
-	buf = &res->map;
+	stage_map_entry(res, &bin, (u8)type, dataSize);
 
-	if (buf->writeSize == 0)
+	return atom_ok;
+}
+
+// Compress entire remaining binary in one call, or hash it for record trailer
+// if connection does not compress. Runs on a dirty scheduler.
+static ERL_NIF_TERM q_stage_data_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ErlNifBinary bin;
+	coninf *res = NULL;
+	u32 offset, start;
+
+	if (!enif_get_resource(env, argv[0], connection_type, (void **) &res))
+		return enif_make_badarg(env);
+	if (!enif_inspect_binary(env, argv[1], &bin))
+		return make_error_tuple(env, "not binary");
+	if (!enif_get_uint(env, argv[2], &offset))
+		return make_error_tuple(env, "not uint");
+
+	DBG("stage data dirty");
+
+	if (!res->doCompr)
 	{
-		writeUint32LE(buf->buf, 0x184D2A50);
-		buf->writeSize = 8;
+		ERL_NIF_TERM termcpy = enif_make_copy(res->env, argv[1]);
+		if (!enif_inspect_binary(res->env, termcpy, &bin))
+			return make_error_tuple(env, "not binary");
+		offset = add_iov_bin(res, &res->data, bin);
+		res->started = 1;
+		return enif_make_uint(env, offset);
 	}
 
-	while ((bin.size+2*4+3) > buf->bufSize - buf->writeSize)
+	start = offset;
+	while (offset < bin.size)
 	{
-		buf->bufSize *= 1.5;
-		buf->buf = realloc(buf->buf, buf->bufSize);
+		u32 written = add_compr_bin(res, &res->data, bin, offset);
+		if (!written)
+			return atom_false;
+		res->started = 1;
+		offset += written;
 	}
-	pos = buf->writeSize;
-
-	// <<EntireLen, SizeName, Name:SizeName/binary, 
-	//   DataType, Size:32/unsigned,UncompressedOffset:32/unsigned>>
-	buf->buf[pos++] = bin.size+2*4+2;
-	buf->buf[pos++] = (u8)bin.size;
-	memcpy(buf->buf+pos, bin.data, bin.size);
-	pos += bin.size;
-	buf->buf[pos++] = (u8)type;
-	writeUint32(buf->buf+pos, dataSize);
-	pos += 4;
-	writeUint32(buf->buf+pos, res->data.uncomprSz);
-
-	buf->writeSize += bin.size+2*4+3;
-	buf->uncomprSz += bin.size+2*4+3;
-
-	return atom_ok;
+	return enif_make_uint(env, offset - start);
 }
 
 static ERL_NIF_TERM q_stage_data(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
@@ -333,40 +488,43 @@ static ERL_NIF_TERM q_stage_data(ErlNifEnv *env, int argc, const ERL_NIF_TERM ar
 
 	DBG("stage data");
 
-	enif_consume_timeslice(env,98);
 	if (!res->doCompr)
 	{
+		ERL_NIF_TERM termcpy;
+		// Only record checksum touches uncompressed data, large events are
+		// hashed on a dirty scheduler.
+		if (DIRTY_CPU && res->integrity == integrity_record &&
+			enif_inspect_binary(env, argv[1], &bin) && bin.size > DIRTY_THRESHOLD)
+			return enif_schedule_nif(env, "stage_data_dirty", DIRTY_CPU, q_stage_data_dirty, argc, argv);
 		// Make a copy to our env. This will keep it in place while we need it.
-		ERL_NIF_TERM termcpy = enif_make_copy(res->env, argv[1]);
+		// Refc binaries are not copied, only referenced.
+		termcpy = enif_make_copy(res->env, argv[1]);
 		if (!enif_inspect_binary(res->env, termcpy, &bin))
 			return make_error_tuple(env, "not binary");
 		offset = add_iov_bin(res, &res->data, bin);
 	}
 	else
 	{
-		if (!enif_inspect_binary(res->env, argv[1], &bin))
+		if (!enif_inspect_binary(env, argv[1], &bin))
 			return make_error_tuple(env, "not binary");
+		// Large events are compressed in one go on a dirty scheduler,
+		// instead of returning to erlang every 64KB.
+		if (DIRTY_CPU && bin.size > offset && bin.size - offset > DIRTY_THRESHOLD)
+			return enif_schedule_nif(env, "stage_data_dirty", DIRTY_CPU, q_stage_data_dirty, argc, argv);
 		offset = add_compr_bin(res, &res->data, bin, offset);
 		if (!offset)
 			return atom_false;
 	}
+	enif_consume_timeslice(env,98);
 	res->started = 1;
 	return enif_make_uint(env, offset);
 }
 
-static ERL_NIF_TERM q_flush(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Finish data and map frames.
+static int stage_flush(coninf *con)
 {
-	coninf *con = NULL;
 	size_t bWritten;
 
-	if (argc != 1)
-		return atom_false;
-
-	if (!enif_get_resource(env, argv[0], connection_type, (void **) &con))
-		return enif_make_badarg(env);
-
-	DBG("flushing");
-
 	// bWritten = LZ4F_compressEnd(con->map.cctx, 
 	// 		con->map.buf + con->map.writeSize, 
 	// 		con->map.bufSize - con->map.writeSize, NULL);
@@ -380,7 +538,7 @@ static ERL_NIF_TERM q_flush(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 				con->data.buf + con->data.writeSize, 
 				con->data.bufSize - con->data.writeSize, NULL);
 		if (LZ4F_isError(bWritten))
-			return atom_false;
+			return 0;
 		con->data.writeSize += bWritten;
 	}
 	else
@@ -388,6 +546,23 @@ static ERL_NIF_TERM q_flush(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 		writeUint32LE(con->data.buf + 4, con->data.writeSize-8);
 	}
 	writeUint32LE(con->map.buf + 4, con->map.writeSize-8);
+	return 1;
+}
+
+static ERL_NIF_TERM q_flush(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	coninf *con = NULL;
+
+	if (argc != 1)
+		return atom_false;
+
+	if (!enif_get_resource(env, argv[0], connection_type, (void **) &con))
+		return enif_make_badarg(env);
+
+	DBG("flushing");
+
+	if (!stage_flush(con))
+		return atom_false;
 
 	enif_consume_timeslice(env,95);
 	return enif_make_tuple2(env, 
@@ -439,42 +614,11 @@ static u32 list_to_bin(u8 *buf, u32 maxSz, ErlNifEnv *env, ERL_NIF_TERM iol)
 	return pos;
 }
 
-// argv0 - Ref
-// argv1 - Pid
-// argv2 - Connection
-// argv3 - Replication data iolist (prepend to sockets)
-// argv4 - Iolist
-static ERL_NIF_TERM q_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Build replication data and header frame for next write.
+static ERL_NIF_TERM stage_header(ErlNifEnv *env, coninf *res, ERL_NIF_TERM replData, ERL_NIF_TERM header)
 {
-	ErlNifPid pid;
-	qitem *item;
-	priv_data *pd = (priv_data*)enif_priv_data(env);
-	db_command *cmd = NULL;
-	coninf *res = NULL;
-
-	if (argc != 5)
-		return make_error_tuple(env, "takes 5 args");
-
-	if(!enif_is_ref(env, argv[0]))
-		return make_error_tuple(env, "invalid_ref");
-	if(!enif_get_local_pid(env, argv[1], &pid))
-		return make_error_tuple(env, "invalid_pid");
-	if (!enif_get_resource(env, argv[2], connection_type, (void **) &res))
-		return enif_make_badarg(env);
-	if (!enif_is_list(env, argv[3]))
-		return make_error_tuple(env, "missing replication data iolist");
-	if (!enif_is_list(env, argv[4]))
-		return make_error_tuple(env, "missing header iolist");
-
-	item = command_create(res->thread, -1, pd);
-	if (!item)
-	{
-		DBG("Returning again!");
-		return atom_again;
-	}
-
 	// Replication data is prepended to header (it is not written to disk)
-	res->replSize = list_to_bin(res->header, HDRMAX, env, argv[3]);
+	res->replSize = list_to_bin(res->header, HDRMAX, env, replData);
 	if (!res->replSize)
 		return make_error_tuple(env, "repl data too large");
 
@@ -482,66 +626,136 @@ static ERL_NIF_TERM q_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 	// 4 bytes marker
 	writeUint32LE(res->header + res->replSize, 0x184D2A50);
 	// Write header 
-	res->headerSize = list_to_bin(res->header + res->replSize + 8, HDRMAX - 8 - res->replSize, env, argv[4]);
+	res->headerSize = list_to_bin(res->header + res->replSize + 8, HDRMAX - 8 - res->replSize, env, header);
 	if (!res->headerSize)
 		return make_error_tuple(env, "header too large");
 	// We now know size so write it before data in reserved 4 bytes.
 	writeUint32LE(res->header + res->replSize + 4, res->headerSize);
 	res->headerSize += 8;
+	return atom_ok;
+}
 
-	enif_keep_resource(res);
-	cmd = (db_command*)item->cmd;
-	cmd->type = cmd_write;
-	cmd->ref = enif_make_copy(item->env, argv[0]);
-	cmd->pid = pid;
-	cmd->conn = res;
-	enif_consume_timeslice(env,95);
-	return push_command(res->thread, -1, pd, item);
+// Expected wait on writer, queue depth times write latency.
+static u64 write_cost(priv_data *pd, int thread)
+{
+	return (queue_length(pd->tasks[thread]) + 1) * 
+		(atomic_load_explicit(&pd->wlatency[thread], memory_order_relaxed) + 1);
 }
 
-static ERL_NIF_TERM q_fsync(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Writer on the same slot in another path if it is at least twice as fast.
+// Connection write is only placed once previous has completed, so order is kept.
+// Connection only moves once a command item for the writer was taken.
+static int place_write(priv_data *pd, coninf *con)
+{
+	const int slot = con->thread % pd->nThreads;
+	const u64 cur = write_cost(pd, con->thread);
+	u64 bestCost = cur;
+	int best = con->thread, i;
+
+	for (i = 0; i < pd->nPaths; i++)
+	{
+		const int thread = i * pd->nThreads + slot;
+		const u64 cost = write_cost(pd, thread);
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			best = thread;
+		}
+	}
+	if (bestCost * 2 < cur)
+		return best;
+	return con->thread;
+}
+
+// XXH64 of record as it will be written, appended as a skippable frame.
+// Data frame past its first 8 bytes was hashed while staging, that hash is the
+// seed for header, map and start of data frame (see record_check).
+// Without record checksums trailer is empty and only marks end of record.
+static void add_trailer(coninf *res)
+{
+	XXH64_state_t st;
+	lz4buf *data = &res->data;
+	u64 seed = 0;
+	u32 dataStart = 8;
+
+	if (data->iovSize == data->iovUsed)
+	{
+		data->iovSize *= 1.5;
+		data->iov = realloc(data->iov, data->iovSize*sizeof(IOV));
+	}
+	if (res->integrity != integrity_record)
+	{
+		write_trailer(res->trailer, 0, 0);
+		IOV_SET(data->iov[data->iovUsed], res->trailer, EMPTY_TRAILER_SIZE);
+		data->iovUsed++;
+		res->trailerSize = EMPTY_TRAILER_SIZE;
+		return;
+	}
+
+	if (res->doCompr)
+	{
+		// Frame end written by flush.
+		if (data->writeSize >= 8)
+			hash_compressed(res, data);
+		dataStart = MIN(8, data->writeSize);
+	}
+	else
+		// Without compression skippable frame header is always written.
+		hash_data(res, NULL, 0);
+	if (res->dataHashed)
+		seed = XXH64_digest(&res->dataHash);
+
+	XXH64_reset(&st, seed);
+	XXH64_update(&st, res->header + res->replSize, res->headerSize);
+	XXH64_update(&st, res->map.buf, res->map.writeSize);
+	XXH64_update(&st, data->buf, dataStart);
+	write_trailer(res->trailer, 1, XXH64_digest(&st));
+	IOV_SET(data->iov[data->iovUsed], res->trailer, TRAILER_SIZE);
+	data->iovUsed++;
+	res->trailerSize = TRAILER_SIZE;
+}
+
+static ERL_NIF_TERM submit_write(ErlNifEnv *env, ERL_NIF_TERM ref, ErlNifPid *pid, coninf *res)
 {
-	coninf *res = NULL;
-	ErlNifPid pid;
 	qitem *item;
-	db_command *cmd = NULL;
+	db_command *cmd;
 	priv_data *pd = (priv_data*)enif_priv_data(env);
-	int sthr = 0;
+	ERL_NIF_TERM answer;
+	int thread = res->thread;
 
-	if(!enif_is_ref(env, argv[0]))
-		return make_error_tuple(env, "invalid_ref");
-	if(!enif_get_local_pid(env, argv[1], &pid))
-		return make_error_tuple(env, "invalid_pid");
-	if (!enif_get_resource(env, argv[2], connection_type, (void **) &res))
-		return enif_make_badarg(env);
+	if (pd->striping && pd->nPaths > 1)
+		thread = place_write(pd, res);
 
-	sthr = res->thread / pd->nThreads;
-	item = command_create(-1, sthr, pd);
+	item = command_create_wait(thread, -1, pd, env, pid, ref, &answer);
 	if (!item)
-	{
-		DBG("Returning again!");
-		return atom_again;
-	}
+		return answer;
+	res->thread = thread;
+
+	add_trailer(res);
 	enif_keep_resource(res);
 	cmd = (db_command*)item->cmd;
-	cmd->type = cmd_sync;
-	cmd->ref = enif_make_copy(item->env, argv[0]);
-	cmd->pid = pid;
+	cmd->type = cmd_write;
+	cmd->ref = enif_make_copy(item->env, ref);
+	cmd->pid = *pid;
 	cmd->conn = res;
+	cmd->seq = ++res->seq;
 	enif_consume_timeslice(env,95);
-	return push_command(-1, sthr, pd, item);
+	return push_command(res->thread, -1, pd, item);
 }
 
-static ERL_NIF_TERM q_inject(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// argv0 - Ref
+// argv1 - Pid
+// argv2 - Connection
+// argv3 - Replication data iolist (prepend to sockets)
+// argv4 - Iolist
+static ERL_NIF_TERM q_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-	coninf *res = NULL;
 	ErlNifPid pid;
-	qitem *item;
-	db_command *cmd = NULL;
-	priv_data *pd = (priv_data*)enif_priv_data(env);
+	coninf *res = NULL;
+	ERL_NIF_TERM rt;
 
-	if (argc != 4)
-		return atom_false;
+	if (argc != 5)
+		return make_error_tuple(env, "takes 5 args");
 
 	if(!enif_is_ref(env, argv[0]))
 		return make_error_tuple(env, "invalid_ref");
@@ -549,28 +763,250 @@ static ERL_NIF_TERM q_inject(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]
 		return make_error_tuple(env, "invalid_pid");
 	if (!enif_get_resource(env, argv[2], connection_type, (void **) &res))
 		return enif_make_badarg(env);
-	if (!enif_is_binary(env, argv[3]))
-		return make_error_tuple(env, "not_bin");
+	if (!enif_is_list(env, argv[3]))
+		return make_error_tuple(env, "missing replication data iolist");
+	if (!enif_is_list(env, argv[4]))
+		return make_error_tuple(env, "missing header iolist");
 
-	item = command_create(res->thread, -1, pd);
-	if (!item)
-	{
-		DBG("Returning again!");
-		return atom_again;
-	}
-	enif_keep_resource(res);
-	cmd = (db_command*)item->cmd;
-	cmd->type = cmd_inject;
-	cmd->ref = enif_make_copy(item->env, argv[0]);
-	cmd->pid = pid;
-	cmd->conn = res;
-	cmd->arg = enif_make_copy(item->env, argv[3]);
-	enif_consume_timeslice(env,95);
-	return push_command(res->thread, -1, pd, item);
-}
+	if ((rt = stage_header(env, res, argv[3], argv[4])) != atom_ok)
+		return rt;
 
+	return submit_write(env, argv[0], &pid, res);
+}
 
-static ERL_NIF_TERM q_init_tls(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Stage every {Name, Type, Data} of list into map and data frames.
+// Returns 0 if list is not valid.
+static int stage_batch(ErlNifEnv *env, coninf *res, ERL_NIF_TERM list)
+{
+	ERL_NIF_TERM head;
+	const ERL_NIF_TERM *tuple;
+	ErlNifBinary name, bin;
+	int arity, type;
+
+	while (enif_get_list_cell(env, list, &head, &list))
+	{
+		if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 3)
+			return 0;
+		if (!enif_inspect_binary(env, tuple[0], &name) || name.size > 128)
+			return 0;
+		if (!enif_get_int(env, tuple[1], &type) || type < 0 || type > 255)
+			return 0;
+		if (!enif_is_binary(env, tuple[2]))
+			return 0;
+
+		if (res->doCompr)
+		{
+			u32 offset = 0;
+
+			if (!enif_inspect_binary(env, tuple[2], &bin))
+				return 0;
+			stage_map_entry(res, &name, (u8)type, bin.size);
+			while (offset < bin.size)
+			{
+				u32 written = add_compr_bin(res, &res->data, bin, offset);
+				if (!written)
+					return 0;
+				res->started = 1;
+				offset += written;
+			}
+		}
+		else
+		{
+			// Keep data alive in connection env until written.
+			ERL_NIF_TERM termcpy = enif_make_copy(res->env, tuple[2]);
+			if (!enif_inspect_binary(res->env, termcpy, &bin))
+				return 0;
+			stage_map_entry(res, &name, (u8)type, bin.size);
+			add_iov_bin(res, &res->data, bin);
+			res->started = 1;
+		}
+	}
+	return stage_flush(res);
+}
+
+// Second part of write_batch. Data is staged, build header and queue write.
+static ERL_NIF_TERM q_write_batch_submit(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ErlNifPid pid;
+	coninf *res = NULL;
+	ERL_NIF_TERM rt;
+
+	if (!enif_get_local_pid(env, argv[1], &pid))
+		return make_error_tuple(env, "invalid_pid");
+	if (!enif_get_resource(env, argv[2], connection_type, (void **) &res))
+		return enif_make_badarg(env);
+
+	if ((rt = stage_header(env, res, argv[4], argv[5])) != atom_ok)
+	{
+		reset_con(res);
+		return rt;
+	}
+
+	rt = submit_write(env, argv[0], &pid, res);
+	// Caller will retry with entire batch.
+	if (rt == atom_again || rt == atom_wait)
+		reset_con(res);
+	return rt;
+}
+
+// Large batches are compressed or hashed on a dirty scheduler.
+static ERL_NIF_TERM q_write_batch_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	coninf *res = NULL;
+
+	if (!enif_get_resource(env, argv[2], connection_type, (void **) &res))
+		return enif_make_badarg(env);
+
+	if (!stage_batch(env, res, argv[3]))
+	{
+		reset_con(res);
+		return make_error_tuple(env, "invalid_event");
+	}
+	return enif_schedule_nif(env, "write_batch", 0, q_write_batch_submit, argc, argv);
+}
+
+// Stage map, data, header and write with a single call.
+// argv0 - Ref
+// argv1 - Pid
+// argv2 - Connection
+// argv3 - [{Name, Type, Data}]
+// argv4 - Replication data iolist (prepend to sockets)
+// argv5 - Header iolist
+static ERL_NIF_TERM q_write_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ErlNifPid pid;
+	coninf *res = NULL;
+	ERL_NIF_TERM head, list;
+	const ERL_NIF_TERM *tuple;
+	ErlNifBinary bin;
+	int arity;
+	u64 total = 0;
+
+	if (argc != 6)
+		return make_error_tuple(env, "takes 6 args");
+
+	if(!enif_is_ref(env, argv[0]))
+		return make_error_tuple(env, "invalid_ref");
+	if(!enif_get_local_pid(env, argv[1], &pid))
+		return make_error_tuple(env, "invalid_pid");
+	if (!enif_get_resource(env, argv[2], connection_type, (void **) &res))
+		return enif_make_badarg(env);
+	if (!enif_is_list(env, argv[3]))
+		return make_error_tuple(env, "missing event list");
+	if (!enif_is_list(env, argv[4]))
+		return make_error_tuple(env, "missing replication data iolist");
+	if (!enif_is_list(env, argv[5]))
+		return make_error_tuple(env, "missing header iolist");
+	if (res->started)
+		return make_error_tuple(env, "stage in progress");
+
+	DBG("write_batch");
+
+	// Uncompressed data is only hashed for record checksum.
+	if (res->doCompr || res->integrity == integrity_record)
+	{
+		list = argv[3];
+		while (enif_get_list_cell(env, list, &head, &list))
+		{
+			if (enif_get_tuple(env, head, &arity, &tuple) && arity == 3 &&
+				enif_inspect_binary(env, tuple[2], &bin))
+				total += bin.size;
+		}
+		if (total > DIRTY_THRESHOLD)
+			return enif_schedule_nif(env, "write_batch_dirty", DIRTY_CPU, q_write_batch_dirty, argc, argv);
+	}
+
+	if (!stage_batch(env, res, argv[3]))
+	{
+		reset_con(res);
+		return make_error_tuple(env, "invalid_event");
+	}
+	return q_write_batch_submit(env, argc, argv);
+}
+
+static ERL_NIF_TERM q_fsync(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	coninf *res = NULL;
+	ErlNifPid pid;
+	qitem *item;
+	db_command *cmd = NULL;
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	int sthr = 0, i;
+	ERL_NIF_TERM answer;
+
+	if(!enif_is_ref(env, argv[0]))
+		return make_error_tuple(env, "invalid_ref");
+	if(!enif_get_local_pid(env, argv[1], &pid))
+		return make_error_tuple(env, "invalid_pid");
+	if (!enif_get_resource(env, argv[2], connection_type, (void **) &res))
+		return enif_make_badarg(env);
+
+	// With striping writes since last fsync may be on several paths. Command
+	// goes to first of them and is passed on once synced there.
+	sthr = res->thread / pd->nThreads;
+	for (i = 0; i < pd->nPaths; i++)
+	{
+		if (res->syncPaths & (1u << i))
+		{
+			sthr = i;
+			break;
+		}
+	}
+	item = command_create_wait(-1, sthr, pd, env, &pid, argv[0], &answer);
+	if (!item)
+		return answer;
+	enif_keep_resource(res);
+	cmd = (db_command*)item->cmd;
+	cmd->syncPaths = res->syncPaths | (1u << sthr);
+	res->syncPaths = 0;
+	cmd->type = cmd_sync;
+	cmd->ref = enif_make_copy(item->env, argv[0]);
+	cmd->pid = pid;
+	cmd->conn = res;
+	enif_consume_timeslice(env,95);
+	return push_command(-1, sthr, pd, item);
+}
+
+static ERL_NIF_TERM q_inject(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	coninf *res = NULL;
+	ErlNifPid pid;
+	qitem *item;
+	db_command *cmd = NULL;
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	ERL_NIF_TERM answer;
+
+	if (argc != 4)
+		return atom_false;
+
+	if(!enif_is_ref(env, argv[0]))
+		return make_error_tuple(env, "invalid_ref");
+	if(!enif_get_local_pid(env, argv[1], &pid))
+		return make_error_tuple(env, "invalid_pid");
+	if (!enif_get_resource(env, argv[2], connection_type, (void **) &res))
+		return enif_make_badarg(env);
+	if (!enif_is_binary(env, argv[3]))
+		return make_error_tuple(env, "not_bin");
+
+	item = command_create_wait(res->thread, -1, pd, env, &pid, argv[0], &answer);
+	if (!item)
+		return answer;
+	enif_keep_resource(res);
+	cmd = (db_command*)item->cmd;
+	cmd->type = cmd_inject;
+	cmd->ref = enif_make_copy(item->env, argv[0]);
+	cmd->pid = pid;
+	cmd->conn = res;
+	// For refc binaries this only increments reference count, data is not copied.
+	// Writer thread uses bin directly.
+	cmd->arg = enif_make_copy(item->env, argv[3]);
+	enif_inspect_binary(item->env, cmd->arg, &cmd->bin);
+	enif_consume_timeslice(env,95);
+	return push_command(res->thread, -1, pd, item);
+}
+
+
+static ERL_NIF_TERM q_init_tls(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
 	priv_data *pd = (priv_data*)enif_priv_data(env);
 	qitem *it;
@@ -582,6 +1018,7 @@ static ERL_NIF_TERM q_init_tls(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv
 		return atom_false;
 	n--;
 	tls_schedIndex = n;
+	queue_set_producer(n);
 
 	it = queue_get_item();
 	pd->schQueues[n] = it->home;
@@ -590,261 +1027,1395 @@ static ERL_NIF_TERM q_init_tls(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv
 	return atom_ok;
 }
 
-static indexitem *insert_index(ErlNifEnv *env, ErlNifBinary *name, qfile *file, u32 pos, int *usedIndex)
+// Find index item of name in index of scheduler sch, create it if not there.
+static indexitem *get_index_item(const u8 *name, u32 size, qfile *file, int sch)
 {
-	art_tree *index = &file->indexes[tls_schedIndex];
-	int i;
+	art_tree *index = &file->indexes[sch];
 	indexitem *item;
-	*usedIndex = -1;
 
-	item = art_search(index, name->data, name->size);
+	item = art_search(index, name, size);
 	if (!item)
 	{
 		item = calloc(1, sizeof(indexitem));
 		item->nPos = 6;
 		item->positions = malloc(item->nPos * sizeof(u32));
 		if (!item->positions)
+		{
+			free(item);
 			return NULL;
+		}
 		item->termEvnum = NULL;
 		memset(item->positions, (u8)~0, item->nPos * sizeof(u32));
-		art_insert(index, name->data, name->size, item);
-		file->indexSizes[tls_schedIndex] += name->size;
+		art_insert(index, name, size, item);
+		file->indexSizes[sch] += size;
+	}
+	return item;
+}
+
+// Append pos to item. Returns index in positions or -1.
+static int add_position(indexitem *item, qfile *file, int sch, u32 pos)
+{
+	if (item->nUsed == item->nPos)
+	{
+		u32 oldSz = item->nPos;
+		item->nPos *= 1.5;
+		item->positions = realloc(item->positions, item->nPos * sizeof(u32));
+		if (!item->positions)
+			return -1;
+		memset(item->positions + oldSz, (u8)~0, (item->nPos - oldSz)*sizeof(u32));
+		if (item->termEvnum)
+		{
+			item->termEvnum = realloc(item->termEvnum, item->nPos * sizeof(u32)*2);
+		}
+	}
+	file->indexSizes[sch] += sizeof(u32);
+	item->positions[item->nUsed] = pos;
+	return item->nUsed++;
+}
+
+// Evterm/evnum of replication event at usedIndex.
+static void add_repl(indexitem *iev, qfile *file, int sch, u32 nameSize, int usedIndex, u64 evterm, u64 evnum)
+{
+	if (!iev->termEvnum)
+	{
+		// Only replication events have termEvnum array.
+		// add_position won't create it, but it will expand it later if needed.
+		iev->termEvnum = calloc(iev->nPos, sizeof(u32)*2);
+		// We store first evterm/evnum so we can use an array of 32bit integers
+		// instead of 64. A very simple way to save quite a bit of space.
+		iev->firstTerm = evterm;
+		iev->firstEvnum = evnum;
+		file->indexSizes[sch] += sizeof(u64)*2;
+	}
+	if (usedIndex >= 0)
+	{
+		// termEvnum will be expanded if needed in add_position.
+		iev->termEvnum[usedIndex*2] = evterm - iev->firstTerm;
+		iev->termEvnum[usedIndex*2+1] = evnum - iev->firstEvnum;
+		// And its entry in evnum db.
+		file->indexSizes[sch] += sizeof(u32)*2 + nameSize + 22;
+	}
+}
+
+// Drop index entries of actor from evnum on. Evnums of actor only grow,
+// so first one to drop is found with binary search.
+static void rewind_item(indexitem *iev, u64 evnum)
+{
+	u32 lo = 0, hi;
+
+	if (!iev || !iev->termEvnum)
+		return;
+	hi = iev->nUsed;
+	while (lo < hi)
+	{
+		const u32 mid = lo + (hi - lo) / 2;
+		if (iev->firstEvnum + iev->termEvnum[mid*2+1] < evnum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	while (iev->nUsed > lo)
+	{
+		iev->nUsed--;
+		iev->positions[iev->nUsed] = (u32)~0;
+		iev->termEvnum[iev->nUsed*2] = 0;
+		iev->termEvnum[iev->nUsed*2+1] = 0;
+	}
+}
+
+// Add position of name to index of scheduler sch.
+static indexitem *insert_index(ErlNifBinary *name, qfile *file, int sch, u32 pos, int *usedIndex)
+{
+	indexitem *item = get_index_item(name->data, name->size, file, sch);
+	*usedIndex = -1;
+	if (!item)
+		return NULL;
+	*usedIndex = add_position(item, file, sch, pos);
+	if (*usedIndex < 0)
+		return NULL;
+	return item;
+}
+
+// Replication event of qactor name.
+static indexitem *insert_repl(ErlNifBinary *name, qfile *file, int sch, u32 pos, u64 evterm, u64 evnum)
+{
+	int usedIndex;
+	indexitem *iev = insert_index(name, file, sch, pos, &usedIndex);
+	if (iev == NULL)
+		return NULL;
+	add_repl(iev, file, sch, name->size, usedIndex, evterm, evnum);
+	return iev;
+}
+
+static void do_rewind(ErlNifBinary *name, qfile *file, int sch, u64 evnum)
+{
+	rewind_item(art_search(&file->indexes[sch], name->data, name->size), evnum);
+}
+
+// Append index update to journal buffer. Sync thread writes it out.
+// Caller holds j->mtx.
+// <<NameLen:16, Type, Name/binary, Pos:32>> for events,
+// followed by <<Evterm:64, Evnum:64>> for replication events,
+// <<NameLen:16, Type, Name/binary, Evnum:64>> for rewind. All little endian.
+static void journal_put(ijournal *j, u8 type, const u8 *name, u32 size, u32 pos, u64 evterm, u64 evnum)
+{
+	const u32 need = 3 + size + 4 + 16;
+	u8 *p;
+
+	if (size > 0xFFFF)
+		return;
+	if (j->size + need > j->cap)
+	{
+		j->cap = MAX(j->cap * 2, MAX(PGSZ, j->size + need));
+		j->buf = realloc(j->buf, j->cap);
+	}
+	p = j->buf + j->size;
+	p[0] = (u8)size;
+	p[1] = (u8)(size >> 8);
+	p[2] = type;
+	memcpy(p + 3, name, size);
+	p += 3 + size;
+	if (type != jentry_rewind)
+	{
+		writeUint32LE(p, pos);
+		p += 4;
+	}
+	if (type != jentry_event)
+	{
+		if (type == jentry_repl)
+		{
+			writeUint32LE(p, (u32)evterm);
+			writeUint32LE(p + 4, (u32)(evterm >> 32));
+			p += 8;
+		}
+		writeUint32LE(p, (u32)evnum);
+		writeUint32LE(p + 4, (u32)(evnum >> 32));
+		p += 8;
+	}
+	j->size = p - j->buf;
+}
+
+// Index updates are staged first and applied once all of them are valid.
+// Nothing is changed if any connection or name list is bad.
+typedef struct ientry
+{
+	qfile *file;
+	const u8 *name;
+	u32 size;
+	u32 pos;
+	u32 seq;
+	u8 type;
+	u64 evterm;
+	u64 evnum;
+} ientry;
+
+typedef struct ibatch
+{
+	ientry *entries;
+	coninf **cons;
+	u32 n;
+	u32 cap;
+	u32 nCons;
+	u32 consCap;
+} ibatch;
+
+static __thread ibatch tls_ibatch;
+
+static int batch_add(ibatch *b, qfile *file, u8 type, const u8 *name, u32 size, u32 pos, u64 evterm, u64 evnum)
+{
+	ientry *e;
+	if (b->n == b->cap)
+	{
+		u32 cap = MAX(64, b->cap * 2);
+		ientry *entries = realloc(b->entries, cap * sizeof(ientry));
+		if (!entries)
+			return 0;
+		b->entries = entries;
+		b->cap = cap;
+	}
+	e = &b->entries[b->n];
+	e->file = file;
+	e->name = name;
+	e->size = size;
+	e->pos = pos;
+	e->seq = b->n++;
+	e->type = type;
+	e->evterm = evterm;
+	e->evnum = evnum;
+	return 1;
+}
+
+// Validate {Con, Names, QName, Evterm, Evnum} and stage its index updates.
+// Returns atom_ok or the error index_events returns.
+static ERL_NIF_TERM batch_stage(ErlNifEnv *env, const ERL_NIF_TERM argv[], ibatch *b)
+{
+	u32 pos;
+	ERL_NIF_TERM tail, head;
+	coninf *res = NULL;
+	qfile *file = NULL;
+	u64 evterm, evnum;
+	ErlNifBinary name, qname;
+
+	if (!enif_get_resource(env, argv[0], connection_type, (void **) &res))
+		return enif_make_badarg(env);
+	if (!enif_inspect_binary(env, argv[2], &qname))
+		return atom_false;
+	if (!enif_get_uint64(env, argv[3], (ErlNifUInt64*)&evterm))
+		return make_error_tuple(env, "evterm_not_integer");
+	if (!enif_get_uint64(env, argv[4], (ErlNifUInt64*)&evnum))
+		return make_error_tuple(env, "evnum_not_integer");
+
+	file = res->lastFile;
+	if (!file)
+		return atom_false;
+	if (!res->fileRefc)
+		return atom_false;
+	// Connection indexes one write, twice in a batch would index it twice.
+	for (pos = 0; pos < b->nCons; pos++)
+	{
+		if (b->cons[pos] == res)
+			return atom_false;
+	}
+	if (b->nCons == b->consCap)
+	{
+		u32 cap = MAX(16, b->consCap * 2);
+		coninf **cons = realloc(b->cons, cap * sizeof(coninf*));
+		if (!cons)
+			return atom_false;
+		b->cons = cons;
+		b->consCap = cap;
+	}
+	b->cons[b->nCons++] = res;
+
+	if (enif_is_atom(env, argv[1]))
+	{
+		// This is a rewind operation. Nothing will be added to index.
+		if (!batch_add(b, file, jentry_rewind, qname.data, qname.size, 0, 0, evnum))
+			return atom_false;
+		return atom_ok;
+	}
+	pos = res->lastWpos;
+
+	// A replication event has N events in it. We index the sub events and the replication
+	// event itself.
+	// First the replication event. Name is name of queue actor.
+	if (!batch_add(b, file, jentry_repl, qname.data, qname.size, pos, evterm, evnum))
+		return atom_false;
+
+	if (enif_is_list(env, argv[1]))
+	{
+		// Now go through list and add all outside events written in this replication event to index.
+		tail = argv[1];
+		while (enif_get_list_cell(env, tail, &head, &tail))
+		{
+			if (!enif_inspect_binary(env, head, &name))
+				return atom_false;
+			if (!batch_add(b, file, jentry_event, name.data, name.size, pos, 0, 0))
+				return atom_false;
+		}
+	}
+	else if (enif_inspect_binary(env, argv[1], &name))
+	{
+		u32 sz;
+		u8 *buf = (u8*)name.data;
+		u8 *bufEnd = (u8*)name.data + name.size;
+
+		if (name.size < 24)
+			return atom_false;
+		// Read header size
+		memcpy(&sz, buf+4, sizeof(sz));
+		// Move over header
+		buf += 8+sz;
+		if (buf+8 >= bufEnd)
+			return atom_false;
+		// Read map size
+		memcpy(&sz, buf+4, sizeof(sz));
+		if (buf+sz+8 >= bufEnd)
+			return atom_false;
+		// Move end marker to end of map
+		bufEnd = buf + sz + 8;
+		buf += 8;
+		// <<EntireLen, SizeName, Name:SizeName/binary, 
+		//   DataType, Size:32/unsigned,UncompressedOffset:32/unsigned>>
+		while (buf < bufEnd)
+		{
+			u8 entireLen = buf[0];
+			u8 sizeLen = buf[1];
+
+			if (!batch_add(b, file, jentry_event, buf+2, sizeLen, pos, 0, 0))
+				return atom_false;
+			buf += entireLen + 1;
+		}
+	}
+	else
+		return atom_false;
+	return atom_ok;
+}
+
+static int ientry_cmp(const void *a, const void *b)
+{
+	const ientry *x = (const ientry*)a;
+	const ientry *y = (const ientry*)b;
+	int c;
+
+	if (x->file != y->file)
+		return x->file < y->file ? -1 : 1;
+	c = memcmp(x->name, y->name, MIN(x->size, y->size));
+	if (c)
+		return c;
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	return x->seq < y->seq ? -1 : 1;
+}
+
+// Apply staged updates to index of scheduler sch.
+// Sorted by segment then name, so ART lookups go in key order and every distinct
+// name is looked up once. Updates of the same name keep their call order.
+// Journal lock is taken once per segment.
+static void batch_apply(ibatch *b, int sch)
+{
+	ijournal *j = NULL;
+	qfile *file = NULL;
+	indexitem *item = NULL;
+	u32 i;
+
+	if (b->n > 1)
+		qsort(b->entries, b->n, sizeof(ientry), ientry_cmp);
+	for (i = 0; i < b->n; i++)
+	{
+		ientry *e = &b->entries[i];
+		int usedIndex;
+
+		if (e->file != file)
+		{
+			if (j)
+				enif_mutex_unlock(j->mtx);
+			file = e->file;
+			j = &file->journal[sch];
+			enif_mutex_lock(j->mtx);
+			item = NULL;
+		}
+		else if (item && (e->size != e[-1].size || memcmp(e->name, e[-1].name, e->size)))
+			item = NULL;
+
+		if (e->type == jentry_rewind)
+		{
+			if (!item)
+				item = art_search(&file->indexes[sch], e->name, e->size);
+			rewind_item(item, e->evnum);
+		}
+		else
+		{
+			if (!item)
+				item = get_index_item(e->name, e->size, file, sch);
+			if (!item)
+				continue;
+			usedIndex = add_position(item, file, sch, e->pos);
+			if (e->type == jentry_repl)
+				add_repl(item, file, sch, e->size, usedIndex, e->evterm, e->evnum);
+		}
+		journal_put(j, e->type, e->name, e->size, e->pos, e->evterm, e->evnum);
+	}
+	if (j)
+		enif_mutex_unlock(j->mtx);
+
+	// Remove references of connections to their files.
+	for (i = 0; i < b->nCons; i++)
+	{
+		coninf *res = b->cons[i];
+		if (res->fileRefc)
+			atomic_fetch_sub(&res->lastFile->conRefs, 1);
+		res->fileRefc = 0;
+	}
+	b->n = 0;
+	b->nCons = 0;
+}
+
+// Caled after replication done. 
+// Must be called after successful replication and before next write call on connection.
+// argv0 - connection
+// argv1 - list of event names
+// argv2 - name of qactor
+// argv3 - evterm
+// argv4 - evnum
+static ERL_NIF_TERM q_index_events(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ibatch *b = &tls_ibatch;
+	ERL_NIF_TERM r;
+
+	if (argc != 5)
+		return atom_false;
+
+	b->n = b->nCons = 0;
+	r = batch_stage(env, argv, b);
+	if (r != atom_ok)
+		return r;
+	batch_apply(b, tls_schedIndex);
+	return atom_ok;
+}
+
+// index_events for many connections with a single call.
+// argv0 - list of {Con, Names, QName, Evterm, Evnum}
+// Either all are indexed or none (first error is returned).
+static ERL_NIF_TERM q_index_events_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ibatch *b = &tls_ibatch;
+	ERL_NIF_TERM tail, head, r;
+	const ERL_NIF_TERM *tuple;
+	int arity;
+
+	if (argc != 1)
+		return atom_false;
+
+	b->n = b->nCons = 0;
+	tail = argv[0];
+	while (enif_get_list_cell(env, tail, &head, &tail))
+	{
+		if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 5)
+			return enif_make_badarg(env);
+		r = batch_stage(env, tuple, b);
+		if (r != atom_ok)
+			return r;
+	}
+	enif_consume_timeslice(env, MIN(100, 1 + b->n / 64));
+	batch_apply(b, tls_schedIndex);
+	return atom_ok;
+}
+
+// Read #{maxbytes => Bytes, maxage => Seconds, minindex => LogIndex} into r.
+// Keys not in map are left alone.
+static int get_retention(ErlNifEnv *env, ERL_NIF_TERM map, retention *r)
+{
+	ERL_NIF_TERM value;
+	ErlNifUInt64 u;
+	ErlNifSInt64 i;
+
+	if (enif_get_map_value(env, map, atom_maxbytes, &value))
+	{
+		if (!enif_get_uint64(env, value, &u))
+			return 0;
+		atomic_store(&r->maxBytes, u);
+	}
+	if (enif_get_map_value(env, map, atom_maxage, &value))
+	{
+		if (!enif_get_uint64(env, value, &u))
+			return 0;
+		atomic_store(&r->maxAge, u);
+	}
+	if (enif_get_map_value(env, map, atom_minindex, &value))
+	{
+		if (!enif_get_int64(env, value, &i))
+			return 0;
+		atomic_store(&r->minIndex, i);
+	}
+	return 1;
+}
+
+// Change retention policy for a path. Applied by sync thread.
+// argv0 - path index
+// argv1 - #{maxbytes => Bytes, maxage => Seconds, minindex => LogIndex}
+static ERL_NIF_TERM q_set_retention(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	int pathIndex;
+
+	if (!enif_get_int(env, argv[0], &pathIndex))
+		return make_error_tuple(env, "not_int");
+	if (pathIndex < 0 || pathIndex >= pd->nPaths)
+		return atom_false;
+	if (!get_retention(env, argv[1], &pd->retain[pathIndex]))
+		return make_error_tuple(env, "invalid_retention");
+	return atom_ok;
+}
+
+static ERL_NIF_TERM q_replicate_opts(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	coninf *res;
+	ErlNifBinary bin;
+
+	DBG("replicate_opts");
+
+	if (!(argc == 3))
+		return enif_make_badarg(env);
+	if(!enif_get_resource(env, argv[0], connection_type, (void **) &res))
+		return make_error_tuple(env, "invalid_connection");
+	if (!enif_inspect_iolist_as_binary(env, argv[1], &bin))
+		return make_error_tuple(env, "not_iolist");
+
+	if (res->packetPrefixSize < bin.size)
+	{
+		free(res->packetPrefix);
+		res->packetPrefixSize = 0;
+		res->packetPrefix = NULL;
+	}
+
+	if (bin.size > 0)
+	{
+		int dorepl;
+		if (!enif_get_int(env,argv[2],&(dorepl)))
+			return make_error_tuple(env, "repltype_not_int");
+		if (!res->packetPrefix)
+			res->packetPrefix = malloc(bin.size);
+
+		res->doReplicate = dorepl;
+		memcpy(res->packetPrefix,bin.data,bin.size);
+		res->packetPrefixSize = bin.size;
+	}
+	else
+	{
+		if (!res->packetPrefix)
+			free(res->packetPrefix);
+		res->packetPrefix = NULL;
+		res->packetPrefixSize = 0;
+		res->doReplicate = 0;
+	}
+	return atom_ok;
+}
+
+
+
+
+typedef struct verifyinf
+{
+	const u8 *map;
+	const recpos *recs;
+	u32 from;
+	u32 to;
+	u32 firstBad;
+} verifyinf;
+
+static void *verify_records(void *arg)
+{
+	verifyinf *v = (verifyinf*)arg;
+	u32 i;
+
+	v->firstBad = ~0;
+	for (i = v->from; i < v->to; i++)
+	{
+		if (!record_check(v->map + v->recs[i].pos, v->recs[i].size))
+		{
+			v->firstBad = i;
+			break;
+		}
+	}
+	return NULL;
+}
+
+// Check checksums of every record in segment. Records are found by walking
+// frame headers, hashing is split between threads.
+// argv0 - path index
+// argv1 - log index
+// argv2 - number of threads
+// Returns {ok, NumRecords, EndPos} or {error, {corrupt, Pos}}
+static ERL_NIF_TERM q_verify_segment(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	ErlNifTid tids[MAX_VERIFY_THREADS];
+	verifyinf vi[MAX_VERIFY_THREADS];
+	char name[PATH_MAX];
+	struct stat st;
+	int pathIndex, nThreads, fd, i;
+	ErlNifSInt64 logIndex;
+	recpos *recs;
+	u32 nRecs, bad = ~0;
+	u64 limit, end;
+	u8 *map;
+	qfile *f;
+
+	if (!enif_get_int(env, argv[0], &pathIndex) || pathIndex < 0 || pathIndex >= pd->nPaths)
+		return enif_make_badarg(env);
+	if (!enif_get_int64(env, argv[1], &logIndex))
+		return enif_make_badarg(env);
+	if (!enif_get_int(env, argv[2], &nThreads))
+		return enif_make_badarg(env);
+	nThreads = MAX(1, MIN(nThreads, MAX_VERIFY_THREADS));
+
+	snprintf(name, sizeof(name), "%s/%lld.q", pd->paths[pathIndex], (long long int)logIndex);
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return make_error_tuple(env, "open");
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return make_error_tuple(env, "stat");
+	}
+	limit = MIN((u64)st.st_size, pd->fileLimit[pathIndex]);
+	// Past real end of segment there may be records from previous use of file.
+	if ((f = file_get(pathIndex, logIndex, pd)) != NULL)
+	{
+		limit = MIN(limit, written_hwm(f, pd->nThreads));
+		file_release(f);
+	}
+	if (limit == 0)
+	{
+		close(fd);
+		return enif_make_tuple3(env, atom_ok, enif_make_uint(env, 0), enif_make_uint64(env, 0));
+	}
+	map = mmap(NULL, limit, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		return make_error_tuple(env, "mmap");
+	}
+	madvise(map, limit, MADV_SEQUENTIAL);
+
+	end = segment_records(map, limit, pd->writeAlign[pathIndex], &recs, &nRecs);
+
+	// Contiguous ranges, so every thread reads sequentially.
+	for (i = 0; i < nThreads; i++)
+	{
+		vi[i].map = map;
+		vi[i].recs = recs;
+		vi[i].from = (u64)nRecs * i / nThreads;
+		vi[i].to = (u64)nRecs * (i+1) / nThreads;
+		tids[i] = 0;
+		if (i > 0 && enif_thread_create("verifythr", &tids[i], verify_records, &vi[i], NULL) != 0)
+		{
+			tids[i] = 0;
+			verify_records(&vi[i]);
+		}
+	}
+	verify_records(&vi[0]);
+	for (i = 0; i < nThreads; i++)
+	{
+		if (tids[i])
+			enif_thread_join(tids[i], NULL);
+		if (vi[i].firstBad < bad)
+			bad = vi[i].firstBad;
+	}
+
+	munmap(map, limit);
+	close(fd);
+	if (bad != (u32)~0)
+	{
+		end = recs[bad].pos;
+		free(recs);
+		return enif_make_tuple2(env, atom_error, 
+			enif_make_tuple2(env, enif_make_atom(env, "corrupt"), enif_make_uint64(env, end)));
+	}
+	free(recs);
+	return enif_make_tuple3(env, atom_ok, enif_make_uint(env, nRecs), enif_make_uint64(env, end));
+}
+
+static ERL_NIF_TERM q_read_range_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM read_range(ErlNifEnv *env, const ERL_NIF_TERM argv[], int dirty)
+{
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	ERL_NIF_TERM *bins, res;
+	ErlNifSInt64 logIndex;
+	ErlNifUInt64 pos, maxBytes, limit, total = 0;
+	u32 nBins = 0, binCap = 64;
+	int pathIndex;
+	segref *ref;
+	recpos rec;
+	qfile *f;
+
+	if (!enif_get_int(env, argv[0], &pathIndex) || pathIndex < 0 || pathIndex >= pd->nPaths)
+		return enif_make_badarg(env);
+	if (!enif_get_int64(env, argv[1], &logIndex))
+		return enif_make_badarg(env);
+	if (!enif_get_uint64(env, argv[2], &pos))
+		return enif_make_badarg(env);
+	if (!enif_get_uint64(env, argv[3], &maxBytes))
+		return enif_make_badarg(env);
+
+	f = file_get(pathIndex, logIndex, pd);
+	if (!f)
+		return make_error_tuple(env, "no segment");
+	if (!f->wmap)
+	{
+		file_release(f);
+		return make_error_tuple(env, "mmap");
+	}
+	// Sealed segments may not be in page cache.
+	if (!dirty && DIRTY_IO && f->sealedAt)
+	{
+		file_release(f);
+		return enif_schedule_nif(env, "read_range_dirty", DIRTY_IO, q_read_range_dirty, 4, argv);
+	}
+
+	// Only what is contiguously written, writes in progress may have holes before them.
+	limit = MIN(written_hwm(f, pd->nThreads), pd->fileLimit[pathIndex]);
+	ref = enif_alloc_resource(segment_type, sizeof(segref));
+	ref->f = f;
+	bins = malloc(binCap * sizeof(ERL_NIF_TERM));
+	while (total < maxBytes)
+	{
+		const u64 next = next_record(f->wmap, pos, limit, pd->writeAlign[pathIndex], &rec);
+		if (!next)
+			break;
+		if (nBins == binCap)
+		{
+			binCap *= 2;
+			bins = realloc(bins, binCap * sizeof(ERL_NIF_TERM));
+		}
+		bins[nBins++] = enif_make_resource_binary(env, ref, f->wmap + rec.pos, rec.size);
+		total += rec.size;
+		pos = next;
+	}
+	if (nBins == 0 && f->sealedAt)
+	{
+		// Nothing more will be written here.
+		const i64 nextIndex = f->next ? f->next->logIndex : logIndex + 1;
+		free(bins);
+		enif_release_resource(ref);
+		return enif_make_tuple2(env, enif_make_atom(env, "eof"), enif_make_int64(env, nextIndex));
+	}
+	res = enif_make_tuple3(env, atom_ok, enif_make_list_from_array(env, bins, nBins), 
+		enif_make_uint64(env, pos));
+	free(bins);
+	// Binaries hold the resource now.
+	enif_release_resource(ref);
+	if (!dirty)
+		enif_consume_timeslice(env, MIN(100, 1 + nBins / 16));
+	return res;
+}
+
+// Records of segment from offset, without copying. Binaries point into segment
+// map and keep it from being retired while referenced.
+// argv0 - path index
+// argv1 - log index
+// argv2 - offset of record (at alignment)
+// argv3 - max bytes, at least one record is returned if there is one
+// Returns {ok, [Bin], NextOffset} or {eof, NextLogIndex} once segment is sealed
+// and offset is past last record.
+static ERL_NIF_TERM q_read_range(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	return read_range(env, argv, 0);
+}
+
+static ERL_NIF_TERM q_read_range_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	return read_range(env, argv, 1);
+}
+
+static ERL_NIF_TERM q_decode_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+static ERL_NIF_TERM decode(ErlNifEnv *env, const ERL_NIF_TERM argv[], int dirty)
+{
+	ErlNifBinary rec, *names = NULL;
+	ERL_NIF_TERM head, tail, res;
+	recframes fr;
+	u32 nNames = 0, pos, end, size, i;
+	u64 total = 0;
+	int all, pass;
+
+	if (!enif_inspect_binary(env, argv[0], &rec))
+		return enif_make_badarg(env);
+	size = record_size(rec.data, rec.size);
+	if (!size || !record_frames(rec.data, size, &fr))
+		return make_error_tuple(env, "invalid record");
+
+	all = !enif_is_list(env, argv[1]);
+	if (!all)
+	{
+		unsigned len;
+		// Improper list
+		if (!enif_get_list_length(env, argv[1], &len))
+			return enif_make_badarg(env);
+		names = malloc(MAX(1,len) * sizeof(ErlNifBinary));
+		if (!names)
+			return atom_false;
+		tail = argv[1];
+		while (enif_get_list_cell(env, tail, &head, &tail))
+		{
+			if (!enif_inspect_binary(env, head, &names[nNames++]))
+			{
+				free(names);
+				return enif_make_badarg(env);
+			}
+		}
+	}
+
+	// First pass sums what needs decompressing, second builds the list.
+	res = enif_make_list(env, 0);
+	end = fr.mapPos + fr.mapSize;
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (pos = fr.mapPos; pos + 2 < end; pos += 1 + rec.data[pos])
+		{
+			// <<EntireLen, SizeName, Name:SizeName/binary, 
+			//   DataType, Size:32/unsigned,UncompressedOffset:32/unsigned>>
+			const u8 *e = rec.data + pos;
+			const u32 nameLen = e[1];
+			u32 dataSize, offset;
+			ERL_NIF_TERM data;
+
+			if (e[0] != nameLen + 10 || pos + 1 + e[0] > end)
+				break;
+			if (!all)
+			{
+				for (i = 0; i < nNames; i++)
+				{
+					if (names[i].size == nameLen && memcmp(names[i].data, e + 2, nameLen) == 0)
+						break;
+				}
+				if (i == nNames)
+					continue;
+			}
+			dataSize = readUint32(e + 3 + nameLen);
+			offset = readUint32(e + 7 + nameLen);
+			if (pass == 0)
+			{
+				total += dataSize;
+				continue;
+			}
+			if (!fr.compressed)
+			{
+				if ((u64)offset + dataSize > fr.dataSize)
+					break;
+				data = enif_make_sub_binary(env, argv[0], fr.dataPos + offset, dataSize);
+			}
+			else
+			{
+				// Only blocks that hold event are decompressed.
+				u8 *out = enif_make_new_binary(env, dataSize, &data);
+				if (!lz4_frame_range(rec.data + fr.dataPos, fr.dataSize, offset, dataSize, out))
+					break;
+			}
+			res = enif_make_list_cell(env, enif_make_tuple3(env,
+				enif_make_sub_binary(env, argv[0], pos + 2, nameLen),
+				enif_make_uint(env, e[2 + nameLen]),
+				data), res);
+		}
+		if (pass == 0 && !dirty && DIRTY_CPU && fr.compressed && total > DIRTY_THRESHOLD)
+		{
+			free(names);
+			return enif_schedule_nif(env, "decode_dirty", DIRTY_CPU, q_decode_dirty, 2, argv);
+		}
+	}
+	free(names);
+	if (pos + 2 < end)
+		return make_error_tuple(env, "invalid map");
+	enif_make_reverse_list(env, res, &res);
+	return enif_make_tuple3(env, atom_ok, 
+		enif_make_sub_binary(env, argv[0], fr.hdrPos, fr.hdrSize), res);
+}
+
+// Events of a record, as returned by read_range.
+// argv0 - record
+// argv1 - list of event names or anything else for all events
+// Returns {ok, Header, [{Name, Type, Data}]} in order events were staged.
+static ERL_NIF_TERM q_decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	return decode(env, argv, 0);
+}
+
+static ERL_NIF_TERM q_decode_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	return decode(env, argv, 1);
+}
+
+static u64 readUint64(const u8 *p)
+{
+	return ((u64)readUint32(p) << 32) | readUint32(p + 4);
+}
+
+static void evnum_end(qfile *f, mdbinf *m, MDB_txn *txn)
+{
+	if (txn)
+		mdb_txn_abort(txn);
+	if (f)
+		file_release(f);
+	else
+		index_close(m);
+}
+
+// Read txn on evnum db of sealed segment. Segments of earlier runs are not in
+// chain, only their index is opened (f is NULL then).
+// On success caller must call evnum_end.
+static ERL_NIF_TERM evnum_txn(ErlNifEnv *env, const ERL_NIF_TERM argv[], qfile **pf, mdbinf **pm, MDB_txn **txn)
+{
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	ErlNifSInt64 logIndex;
+	int pathIndex;
+	qfile *f;
+	mdbinf *m;
+
+	if (!enif_get_int(env, argv[0], &pathIndex) || pathIndex < 0 || pathIndex >= pd->nPaths)
+		return enif_make_badarg(env);
+	if (!enif_get_int64(env, argv[1], &logIndex))
+		return enif_make_badarg(env);
+
+	f = file_get(pathIndex, logIndex, pd);
+	if (f)
+		m = f->mdb;
+	else if ((m = index_open(pathIndex, logIndex, pd)) == NULL)
+		return make_error_tuple(env, "no segment");
+	// Index is created once segment is synced.
+	if (!m || !m->hasEvdb)
+	{
+		evnum_end(f, m, NULL);
+		return make_error_tuple(env, "not indexed");
+	}
+	if (mdb_txn_begin(m->env, NULL, MDB_RDONLY, txn) != MDB_SUCCESS)
+	{
+		evnum_end(f, m, NULL);
+		return make_error_tuple(env, "txn");
+	}
+	*pf = f;
+	*pm = m;
+	return atom_ok;
+}
+
+// Replication events of actor in segment with evnum larger than given.
+// argv0 - path index
+// argv1 - log index
+// argv2 - name of qactor
+// argv3 - evnum
+// Returns {ok, [{Evterm, Evnum, Pos}]} or {error, "not indexed"} if segment is still written to.
+static ERL_NIF_TERM q_find_evnum(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ERL_NIF_TERM res, list;
+	ErlNifBinary name;
+	ErlNifUInt64 evnum;
+	MDB_cursor *cur;
+	MDB_txn *txn;
+	MDB_val k, v;
+	qfile *f;
+	mdbinf *m;
+	u8 *kbuf;
+	int rc;
+
+	if (!enif_inspect_binary(env, argv[2], &name) || name.size == 0 || name.size > 0xFFFF)
+		return enif_make_badarg(env);
+	if (!enif_get_uint64(env, argv[3], &evnum))
+		return enif_make_badarg(env);
+	res = evnum_txn(env, argv, &f, &m, &txn);
+	if (res != atom_ok)
+		return res;
+
+	kbuf = malloc(2 + name.size + 8);
+	kbuf[0] = (u8)(name.size >> 8);
+	kbuf[1] = (u8)name.size;
+	memcpy(kbuf + 2, name.data, name.size);
+	evnum++;
+	writeUint32(kbuf + 2 + name.size, (u32)(evnum >> 32));
+	writeUint32(kbuf + 2 + name.size + 4, (u32)evnum);
+	k.mv_data = kbuf;
+	k.mv_size = 2 + name.size + 8;
+
+	list = enif_make_list(env, 0);
+	if (mdb_cursor_open(txn, m->evdb, &cur) == MDB_SUCCESS)
+	{
+		rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE);
+		while (rc == MDB_SUCCESS && 
+			k.mv_size == 2 + name.size + 8 && v.mv_size == 12 &&
+			memcmp(k.mv_data, kbuf, 2 + name.size) == 0)
+		{
+			const u8 *kd = (const u8*)k.mv_data + 2 + name.size;
+			const u8 *vd = (const u8*)v.mv_data;
+			list = enif_make_list_cell(env, enif_make_tuple3(env,
+				enif_make_uint64(env, readUint64(vd)),
+				enif_make_uint64(env, readUint64(kd)),
+				enif_make_uint(env, readUint32(vd + 8))), list);
+			rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT);
+		}
+		mdb_cursor_close(cur);
+	}
+	evnum_end(f, m, txn);
+	free(kbuf);
+	enif_make_reverse_list(env, list, &list);
+	return enif_make_tuple2(env, atom_ok, list);
+}
+
+// Lowest and highest evnum of replication events in segment.
+// argv0 - path index
+// argv1 - log index
+// Returns {ok, Min, Max}, {ok, undefined} without replication events or {error, Reason}.
+static ERL_NIF_TERM q_segment_evnums(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ERL_NIF_TERM res;
+	MDB_txn *txn;
+	MDB_val k, v;
+	u8 kbuf[2] = {0,0};
+	qfile *f;
+	mdbinf *m;
+
+	res = evnum_txn(env, argv, &f, &m, &txn);
+	if (res != atom_ok)
+		return res;
+	k.mv_data = kbuf;
+	k.mv_size = sizeof(kbuf);
+	if (mdb_get(txn, m->evdb, &k, &v) == MDB_SUCCESS && v.mv_size == 16)
+		res = enif_make_tuple3(env, atom_ok, 
+			enif_make_uint64(env, readUint64(v.mv_data)),
+			enif_make_uint64(env, readUint64((u8*)v.mv_data + 8)));
+	else
+		res = enif_make_tuple2(env, atom_ok, enif_make_atom(env, "undefined"));
+	evnum_end(f, m, txn);
+	return res;
+}
+
+// Where to start reading path to get everything written since time.
+// Segment is found from time of its first write, position from checkpoints
+// of writers, in segment index once it is sealed.
+// argv0 - path index
+// argv1 - erlang system time in ms
+// Returns {ok, LogIndex, Offset}. Records before Offset were written before time.
+static ERL_NIF_TERM q_seek_time(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	ErlNifUInt64 time;
+	ERL_NIF_TERM res;
+	int pathIndex;
+	u64 pos = 0;
+	MDB_txn *txn;
+	qfile *f;
+
+	if (!enif_get_int(env, argv[0], &pathIndex) || pathIndex < 0 || pathIndex >= pd->nPaths)
+		return enif_make_badarg(env);
+	if (!enif_get_uint64(env, argv[1], &time))
+		return enif_make_badarg(env);
+
+	f = file_get_time(pathIndex, time, pd);
+	if (!f)
+		return make_error_tuple(env, "no segment");
+	if (f->mdb && f->mdb->hasTimedb && 
+		mdb_txn_begin(f->mdb->env, NULL, MDB_RDONLY, &txn) == MDB_SUCCESS)
+	{
+		MDB_cursor *cur;
+		MDB_val k, v;
+		u8 kbuf[8];
+		int rc;
+
+		writeUint32(kbuf, (u32)(time >> 32));
+		writeUint32(kbuf + 4, (u32)time);
+		k.mv_data = kbuf;
+		k.mv_size = sizeof(kbuf);
+		if (mdb_cursor_open(txn, f->mdb->timedb, &cur) == MDB_SUCCESS)
+		{
+			// Last checkpoint at or before time.
+			rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE);
+			if (rc == MDB_NOTFOUND)
+				rc = mdb_cursor_get(cur, &k, &v, MDB_LAST);
+			else if (rc == MDB_SUCCESS && readUint64(k.mv_data) > time)
+				rc = mdb_cursor_get(cur, &k, &v, MDB_PREV);
+			if (rc == MDB_SUCCESS && readUint64(k.mv_data) <= time && v.mv_size == 8)
+				pos = readUint64(v.mv_data);
+			mdb_cursor_close(cur);
+		}
+		mdb_txn_abort(txn);
+	}
+	else
+		pos = time_pos(f, time, pd->nThreads);
+	res = enif_make_tuple3(env, atom_ok, enif_make_int64(env, f->logIndex), enif_make_uint64(env, pos));
+	file_release(f);
+	return res;
+}
+
+// Subscribe process to new records on path.
+// argv0 - path index
+// argv1 - log index
+// argv2 - offset in file, subscriber is notified once records land past it
+// argv3 - pid
+// argv4 - 1 to be notified once written, 0 once synced
+static ERL_NIF_TERM q_subscribe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	subscriber *s;
+	ErlNifSInt64 logIndex;
+	ErlNifUInt64 pos;
+	int pathIndex, unsafe;
+	ErlNifPid pid;
+
+	if (!enif_get_int(env, argv[0], &pathIndex) || pathIndex < 0 || pathIndex >= pd->nPaths)
+		return enif_make_badarg(env);
+	if (!enif_get_int64(env, argv[1], &logIndex))
+		return enif_make_badarg(env);
+	if (!enif_get_uint64(env, argv[2], &pos))
+		return enif_make_badarg(env);
+	if (!enif_get_local_pid(env, argv[3], &pid))
+		return enif_make_badarg(env);
+	if (!enif_get_int(env, argv[4], &unsafe))
+		return enif_make_badarg(env);
+
+	s = calloc(1, sizeof(subscriber));
+	if (!s)
+		return atom_false;
+	s->pid = pid;
+	s->logIndex = logIndex;
+	s->pos = pos;
+	s->unsafe = unsafe ? 1 : 0;
+	enif_mutex_lock(pd->subMtx[pathIndex]);
+	s->next = pd->subs[pathIndex];
+	pd->subs[pathIndex] = s;
+	enif_mutex_unlock(pd->subMtx[pathIndex]);
+	return atom_ok;
+}
+
+// argv0 - path index
+// argv1 - pid
+static ERL_NIF_TERM q_unsubscribe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	priv_data *pd = (priv_data*)enif_priv_data(env);
+	subscriber *s, **prev;
+	int pathIndex;
+	ErlNifPid pid;
+
+	if (!enif_get_int(env, argv[0], &pathIndex) || pathIndex < 0 || pathIndex >= pd->nPaths)
+		return enif_make_badarg(env);
+	if (!enif_get_local_pid(env, argv[1], &pid))
+		return enif_make_badarg(env);
+
+	enif_mutex_lock(pd->subMtx[pathIndex]);
+	prev = &pd->subs[pathIndex];
+	while ((s = *prev) != NULL)
+	{
+		if (enif_is_identical(enif_make_pid(env, &s->pid), argv[1]))
+		{
+			*prev = s->next;
+			free(s);
+			continue;
+		}
+		prev = &s->next;
+	}
+	enif_mutex_unlock(pd->subMtx[pathIndex]);
+	return atom_ok;
+}
+
+// Option that is either an integer for all paths or a tuple with value for every path.
+static int get_path_opt(ErlNifEnv *env, ERL_NIF_TERM info, ERL_NIF_TERM key, int pathIndex, u64 *out)
+{
+	ERL_NIF_TERM value;
+	const ERL_NIF_TERM *tuple;
+	int arity;
+
+	if (!enif_get_map_value(env, info, key, &value))
+		return 1;
+	if (enif_get_tuple(env, value, &arity, &tuple))
+	{
+		if (pathIndex >= arity)
+			return 0;
+		value = tuple[pathIndex];
+	}
+	return enif_get_uint64(env, value, (ErlNifUInt64*)out);
+}
+
+// filelimit - segment size. Positions within segment are u32.
+// align - power of 2, below WRITE_ALIGNMENT is packed mode (1 is no alignment).
+// In direct mode alignment must be a multiple of dalign.
+static int get_segment_opts(ErlNifEnv *env, ERL_NIF_TERM info, int pathIndex, priv_data *priv)
+{
+	u64 limit = FILE_LIMIT;
+	u64 align = priv->wmode == wmode_direct ? priv->dalign : WRITE_ALIGNMENT;
+
+	if (!get_path_opt(env, info, atom_filelimit, pathIndex, &limit) ||
+		!get_path_opt(env, info, atom_align, pathIndex, &align))
+		return 0;
+	if (!align || (align & (align - 1)) || align > 1024*1024)
+		return 0;
+	if (priv->wmode == wmode_direct && align < priv->dalign)
+		return 0;
+	if (limit < 1024*1024 || limit >= 0xFFFFFFFFULL || limit % align)
+		return 0;
+	priv->writeAlign[pathIndex] = align;
+	priv->fileLimit[pathIndex] = limit;
+	return 1;
+}
+
+static int cpu_in_list(ErlNifEnv *env, ERL_NIF_TERM list, int cpu)
+{
+	ERL_NIF_TERM head;
+	int c;
+
+	while (enif_get_list_cell(env, list, &head, &list))
+	{
+		if (enif_get_int(env, head, &c) && c == cpu)
+			return 1;
+	}
+	return 0;
+}
+
+// cpus - tuple with a list of cpus for every path, or numa to use cpus of the
+// node that path's disk is attached to. Threads of path are pinned to them.
+// exclude - cpus that are never used (like those Erlang schedulers are bound to).
+static int get_path_cpus(ErlNifEnv *env, ERL_NIF_TERM info, int pathIndex, priv_data *priv)
+{
+	ERL_NIF_TERM value, head, list;
+	const ERL_NIF_TERM *tuple;
+	int arity, i, j, n = 0;
+	int *cpus;
+
+	if (!enif_get_map_value(env, info, atom_cpus, &value))
+		return 1;
+	cpus = calloc(MAX_CPUS, sizeof(int));
+	if (value == atom_numa)
+	{
+		const int node = path_numa_node(priv->paths[pathIndex]);
+		DBG("Path %d on numa node %d", pathIndex, node);
+		if (node >= 0)
+			n = node_cpus(node, cpus, MAX_CPUS);
 	}
-	else
+	else if (enif_get_tuple(env, value, &arity, &tuple) && pathIndex < arity)
 	{
-		if (item->positions[item->nPos-1] != (u32)~0)
+		list = tuple[pathIndex];
+		while (n < MAX_CPUS && enif_get_list_cell(env, list, &head, &list))
 		{
-			u32 oldSz = item->nPos;
-			item->nPos *= 1.5;
-			item->positions = realloc(item->positions, item->nPos * sizeof(u32));
-			memset(item->positions + oldSz, (u8)~0, (item->nPos - oldSz)*sizeof(u32));
-			if (!item->positions)
-				return NULL;
-			if (item->termEvnum)
+			if (!enif_get_int(env, head, &cpus[n++]))
 			{
-				item->termEvnum = realloc(item->termEvnum, item->nPos * sizeof(u32)*2);
+				free(cpus);
+				return 0;
 			}
 		}
 	}
-	for (i = 0; i < item->nPos; i++)
+	else
 	{
-		if (item->positions[i] == (u32)~0)
-		{
-			file->indexSizes[tls_schedIndex] += sizeof(u32);
-			item->positions[i] = pos;
-			*usedIndex = i;
-			break;
-		}
+		free(cpus);
+		return 0;
 	}
-	return item;
-}
-
-static void do_rewind(ErlNifEnv *env, qfile *file, ERL_NIF_TERM nameTerm, u64 evnum)
-{
-	indexitem *iev;
-	ErlNifBinary name;
-
-	if (!enif_inspect_binary(env, nameTerm, &name))
-		return;
-	iev = art_search(&file->indexes[tls_schedIndex], name.data, name.size);
-	if (iev->termEvnum)
+	if (enif_get_map_value(env, info, atom_exclude, &value))
 	{
-		int i;
-		for (i = 0; i < iev->nPos; i++)
+		for (i = 0, j = 0; i < n; i++)
 		{
-			if (iev->termEvnum[i*2+1] >= evnum)
-			{
-				iev->positions[i] = (u32)~0;
-				iev->termEvnum[i*2+1] = 0;
-				iev->termEvnum[i*2] = 0;
-				break;
-			}
+			if (!cpu_in_list(env, value, cpus[i]))
+				cpus[j++] = cpus[i];
 		}
+		n = j;
 	}
+	priv->cpus[pathIndex] = cpus;
+	priv->nCpus[pathIndex] = n;
+	return 1;
 }
 
-// Caled after replication done. 
-// Must be called after successful replication and before next write call on connection.
-// argv0 - connection
-// argv1 - list of event names
-// argv2 - name of qactor
-// argv3 - evterm
-// argv4 - evnum
-static ERL_NIF_TERM q_index_events(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Build index of segment from its journal.
+static void replay_journal(int pathIndex, i64 logIndex, const char *name, priv_data *pd)
 {
-	// priv_data *pd = (priv_data*)enif_priv_data(env);
-	u32 pos;
-	ERL_NIF_TERM tail, head;
-	coninf *res = NULL;
-	qfile *file = NULL;
-	u64 evterm, evnum;
-	indexitem *iev;
-	int usedIndex;
-	ErlNifBinary name;
-
-	if (argc != 5)
-		return atom_false;
-
-	if (!enif_get_resource(env, argv[0], connection_type, (void **) &res))
-		return enif_make_badarg(env);
-	if (!enif_is_binary(env, argv[2]))
-		return atom_false;
-	if (!enif_get_uint64(env, argv[3], (ErlNifUInt64*)&evterm))
-		return make_error_tuple(env, "evterm_not_integer");
-	if (!enif_get_uint64(env, argv[4], (ErlNifUInt64*)&evnum))
-		return make_error_tuple(env, "evnum_not_integer");
+	qfile *f;
+	struct stat st;
+	u8 *buf;
+	u32 pos = 0;
+	int fd, usedIndex;
 
-	file = res->lastFile;
-	if (!file)
-		return atom_false;
-	if (!res->fileRefc)
-		return atom_false;
-	if (enif_is_atom(env, argv[1]))
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > 0xFFFFFFFF)
 	{
-		// Remove reference this is a rewind operation.
-		// Nothing will be added to index.
-		if (res->fileRefc)
-			atomic_fetch_sub(&file->conRefs, 1);
-		res->fileRefc = 0;
-		do_rewind(env, file, argv[2], evnum);
-		return atom_ok;
+		close(fd);
+		return;
 	}
-	pos = res->lastWpos;
-
-	// A replication event has N events in it. We index the sub events and the replication
-	// event itself.
-	// First write the replication event. Name is name of queue actor. Prepended with a 0
-	// so it is distinguished from regular outside events.
-	if (!enif_inspect_binary(env, argv[2], &name))
-		return atom_false;
-	iev = insert_index(env, &name, file, pos, &usedIndex);
-	if (iev == NULL)
-		return atom_false;
-	if (!iev->termEvnum)
+	buf = malloc(st.st_size);
+	if (read(fd, buf, st.st_size) != st.st_size)
 	{
-		// Only replication events have termEvnum array.
-		// insert_index won't create it, but it will expand it later if needed.
-		iev->termEvnum = calloc(iev->nPos, sizeof(u32)*2);
-		// We store first evterm/evnum so we can use an array of 32bit integers
-		// instead of 64. A very simple way to save quite a bit of space.
-		iev->firstTerm = evterm;
-		iev->firstEvnum = evnum;
-		file->indexSizes[tls_schedIndex] += sizeof(u64)*2;
+		close(fd);
+		free(buf);
+		return;
 	}
-	if (usedIndex >= 0)
+	close(fd);
+
+	f = calloc(1, sizeof(qfile));
+	f->indexes = calloc(pd->nSch, sizeof(art_tree));
+	f->indexSizes = calloc(pd->nSch, sizeof(u32));
+	f->logIndex = logIndex;
+	f->fd = f->dfd = f->jfd = -1;
+	// Last entry may be torn if crash was during journal write.
+	while (pos + 3 <= st.st_size)
 	{
-		// termEvnum will be expanded if needed in insert_index.
-		iev->termEvnum[usedIndex*2] = evterm - iev->firstTerm;
-		iev->termEvnum[usedIndex*2+1] = evnum - iev->firstEvnum;
-		file->indexSizes[tls_schedIndex] += sizeof(u32)*2;
+		ErlNifBinary ename;
+		const u8 *p = buf + pos;
+		const u32 len = p[0] | ((u32)p[1] << 8);
+		const u8 type = p[2];
+		u32 need = 3 + len;
+
+		if (type == jentry_event)
+			need += 4;
+		else if (type == jentry_repl)
+			need += 20;
+		else if (type == jentry_rewind)
+			need += 8;
+		else
+			break;
+		if (pos + need > st.st_size)
+			break;
+		ename.data = (u8*)p + 3;
+		ename.size = len;
+		p += 3 + len;
+		if (type == jentry_event)
+			insert_index(&ename, f, 0, readUint32LE(p), &usedIndex);
+		else if (type == jentry_repl)
+			insert_repl(&ename, f, 0, readUint32LE(p), 
+				readUint32LE(p + 4) | ((u64)readUint32LE(p + 8) << 32),
+				readUint32LE(p + 12) | ((u64)readUint32LE(p + 16) << 32));
+		else
+			do_rewind(&ename, f, 0, readUint32LE(p) | ((u64)readUint32LE(p + 4) << 32));
+		pos += need;
 	}
+	free(buf);
+
+	// Journal is deleted once index is created.
+	create_index(pathIndex, f, pd);
+	if (f->mdb)
+		close_handles(pathIndex, f, pd);
+	free(f->indexes);
+	free(f->indexSizes);
+	free(f);
+}
 
-	if (enif_is_list(env, argv[1]))
+// Segments below startIndex with a journal were not indexed before a crash
+// or shutdown. Journals from startIndex on are for segments that will be
+// written again.
+static void replay_journals(int pathIndex, i64 startIndex, priv_data *pd)
+{
+	DIR *dir = opendir(pd->paths[pathIndex]);
+	struct dirent *de;
+
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != NULL)
 	{
-		// Now go through list and add all outside events written in this replication event to index.
-		tail = argv[1];
-		while (enif_get_list_cell(env, tail, &head, &tail))
+		char name[PATH_MAX];
+		char *end;
+		struct stat st;
+		const i64 logIndex = strtoll(de->d_name, &end, 10);
+
+		if (end == de->d_name || strcmp(end, ".ijournal") != 0)
+			continue;
+		snprintf(name, sizeof(name), "%s/%lld.index", pd->paths[pathIndex], (long long int)logIndex);
+		if (logIndex < startIndex && stat(name, &st) != 0)
 		{
-			if (!enif_inspect_binary(env, head, &name))
-				return atom_false;
-			if (insert_index(env, &name, file, pos, &usedIndex) == NULL)
-				return atom_false;
+			snprintf(name, sizeof(name), "%s/%s", pd->paths[pathIndex], de->d_name);
+			replay_journal(pathIndex, logIndex, name, pd);
 		}
-	}
-	else if(!enif_inspect_binary(env, argv[1], &name))
-	{
-		u32 sz;
-		u8 *buf = (u8*)name.data;
-		u8 *bufEnd = (u8*)name.data + name.size;
-
-		if (name.size < 24)
-			return atom_false;
-		// Read header size
-		memcpy(&sz, buf+4, sizeof(sz));
-		// Move over header
-		buf += 8+sz;
-		if (buf+8 >= bufEnd)
-			return atom_false;
-		// Read map size
-		memcpy(&sz, buf+4, sizeof(sz));
-		if (buf+sz+8 >= bufEnd)
-			return atom_false;
-		// Move end marker to end of map
-		bufEnd = buf + sz + 8;
-		buf += 8;
-		// <<EntireLen, SizeName, Name:SizeName/binary, 
-		//   DataType, Size:32/unsigned,UncompressedOffset:32/unsigned>>
-		while (buf < bufEnd)
+		else
 		{
-			u8 entireLen = buf[0];
-			u8 sizeLen = buf[1];
-			ErlNifBinary cname;
-
-			cname.data = buf+2;
-			cname.size = sizeLen;
-
-			if (insert_index(env, &cname, file, pos, &usedIndex) == NULL)
-				return atom_false;
-
-			buf += entireLen + 1;
+			snprintf(name, sizeof(name), "%s/%s", pd->paths[pathIndex], de->d_name);
+			unlink(name);
 		}
 	}
-	else
-		return atom_false;
-	// Remove reference for connection to file.
-	atomic_fetch_sub(&file->conRefs, 1);
-	res->fileRefc = 0;
-
-	return atom_ok;
+	closedir(dir);
 }
 
-static ERL_NIF_TERM q_replicate_opts(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Spare segments made by pthread_prealloc in previous run go back to recycle list,
+// unless they were given in recycle option.
+static void add_spares(int pathIndex, priv_data *pd)
 {
-	coninf *res;
-	ErlNifBinary bin;
-
-	DBG("replicate_opts");
-
-	if (!(argc == 3))
-		return enif_make_badarg(env);
-	if(!enif_get_resource(env, argv[0], connection_type, (void **) &res))
-		return make_error_tuple(env, "invalid_connection");
-	if (!enif_inspect_iolist_as_binary(env, argv[1], &bin))
-		return make_error_tuple(env, "not_iolist");
-
-	if (res->packetPrefixSize < bin.size)
-	{
-		free(res->packetPrefix);
-		res->packetPrefixSize = 0;
-		res->packetPrefix = NULL;
-	}
+	DIR *dir = opendir(pd->paths[pathIndex]);
+	struct dirent *de;
 
-	if (bin.size > 0)
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != NULL)
 	{
-		int dorepl;
-		if (!enif_get_int(env,argv[2],&(dorepl)))
-			return make_error_tuple(env, "repltype_not_int");
-		if (!res->packetPrefix)
-			res->packetPrefix = malloc(bin.size);
+		u32 t, counter;
+		int len = 0;
+		recq *r;
 
-		res->doReplicate = dorepl;
-		memcpy(res->packetPrefix,bin.data,bin.size);
-		res->packetPrefixSize = bin.size;
-	}
-	else
-	{
-		if (!res->packetPrefix)
-			free(res->packetPrefix);
-		res->packetPrefix = NULL;
-		res->packetPrefixSize = 0;
-		res->doReplicate = 0;
+		if (sscanf(de->d_name, "p%x_%u.r%n", &t, &counter, &len) != 2 ||
+			len == 0 || de->d_name[len] != 0 || len >= (int)sizeof(r->name))
+			continue;
+		for (r = pd->recycle[pathIndex]; r != NULL; r = r->next)
+		{
+			if (strcmp(r->name, de->d_name) == 0)
+				break;
+		}
+		if (r == NULL)
+			recycle_push(pd, pathIndex, de->d_name);
 	}
-	return atom_ok;
+	closedir(dir);
 }
 
-
-
-
 static int on_load(ErlNifEnv* env, void** priv_out, ERL_NIF_TERM info)
 {
 	priv_data *priv;
@@ -871,13 +2442,44 @@ static int on_load(ErlNifEnv* env, void** priv_out, ERL_NIF_TERM info)
 	atom_tcpfail = enif_make_atom(env, "tcpfail");
 	atom_drivername = enif_make_atom(env, "aqdrv");
 	atom_again = enif_make_atom(env, "again");
+	atom_wait = enif_make_atom(env, "wait");
+	atom_hwm = enif_make_atom(env, "aqdrv_hwm");
+	atom_notify = enif_make_atom(env, "notify");
 	atom_schedulers = enif_make_atom(env, "schedulers");
 	atom_recycle = enif_make_atom(env, "recycle");
+	atom_rings = enif_make_atom(env, "rings");
+	atom_retention = enif_make_atom(env, "retention");
+	atom_maxbytes = enif_make_atom(env, "maxbytes");
+	atom_maxage = enif_make_atom(env, "maxage");
+	atom_minindex = enif_make_atom(env, "minindex");
+	atom_prealloc = enif_make_atom(env, "prealloc");
+	atom_prezero = enif_make_atom(env, "prezero");
+	atom_wmode = enif_make_atom(env, "wmode");
+	atom_direct = enif_make_atom(env, "direct");
+	atom_pwrite = enif_make_atom(env, "pwrite");
+	atom_mmap = enif_make_atom(env, "mmap");
+	atom_dalign = enif_make_atom(env, "dalign");
+	atom_filelimit = enif_make_atom(env, "filelimit");
+	atom_align = enif_make_atom(env, "align");
+	atom_prefault = enif_make_atom(env, "prefault");
+	atom_handles = enif_make_atom(env, "handles");
+	atom_striping = enif_make_atom(env, "striping");
+	atom_timeindex = enif_make_atom(env, "timeindex");
+	atom_timeindexmb = enif_make_atom(env, "timeindexmb");
+	atom_cpus = enif_make_atom(env, "cpus");
+	atom_numa = enif_make_atom(env, "numa");
+	atom_exclude = enif_make_atom(env, "exclude");
+	atom_iorate = enif_make_atom(env, "iorate");
+	atom_iops = enif_make_atom(env, "iops");
 
 	connection_type = enif_open_resource_type(env, NULL, "connection_type",
 		destruct_connection, ERL_NIF_RT_CREATE, NULL);
 	if(!connection_type)
 		return -1;
+	segment_type = enif_open_resource_type(env, NULL, "segment_type",
+		destruct_segment, ERL_NIF_RT_CREATE, NULL);
+	if(!segment_type)
+		return -1;
 
 	#ifdef _TESTDBG_
 	if (enif_get_map_value(env, info, atom_logname, &value))
@@ -900,6 +2502,99 @@ static int on_load(ErlNifEnv* env, void** priv_out, ERL_NIF_TERM info)
 		DBG("nschd=%d",priv->nSch);
 		priv->schQueues = calloc(priv->nSch, sizeof(intq*));
 	}
+	if (enif_get_map_value(env, info, atom_rings, &value))
+	{
+		// Size of SPSC ring between every scheduler and writer thread.
+		// Must be a power of 2. 0 means only MPSC queues are used.
+		if (!enif_get_uint(env, value, &priv->ringSize))
+			return -1;
+		if (priv->ringSize & (priv->ringSize - 1))
+		{
+			DBG("Ring size not power of 2");
+			return -1;
+		}
+	}
+	priv->dalign = DIRECT_ALIGNMENT;
+	if (enif_get_map_value(env, info, atom_wmode, &value))
+	{
+		if (value == atom_direct)
+			priv->wmode = wmode_direct;
+		else if (value == atom_pwrite)
+			priv->wmode = wmode_pwrite;
+		else if (value == atom_mmap)
+			priv->wmode = wmode_mmap;
+		else
+			return -1;
+	}
+	if (enif_get_map_value(env, info, atom_dalign, &value))
+	{
+		// Alignment of writes in direct mode. Power of 2, at least
+		// device logical block size.
+		if (!enif_get_uint(env, value, &priv->dalign))
+			return -1;
+		if (priv->dalign < WRITE_ALIGNMENT || (priv->dalign & (priv->dalign - 1)))
+		{
+			DBG("Invalid dalign");
+			return -1;
+		}
+	}
+	if (enif_get_map_value(env, info, atom_prefault, &value))
+	{
+		// In MB. Only mmap writers touch the mapping, in pwrite mode it is ignored.
+		// Direct writes would have to flush prefaulted pages first.
+		if (!enif_get_uint(env, value, &priv->prefault) || priv->prefault >= 4096)
+			return -1;
+		if (priv->prefault && priv->wmode == wmode_direct)
+		{
+			DBG("prefault with direct writes");
+			return -1;
+		}
+		priv->prefault *= 1024*1024;
+	}
+	if (enif_get_map_value(env, info, atom_striping, &value))
+	{
+		int striping;
+		if (!enif_get_int(env, value, &striping))
+			return -1;
+		priv->striping = striping ? 1 : 0;
+	}
+	priv->notifyInterval = NOTIFY_INTERVAL;
+	if (enif_get_map_value(env, info, atom_notify, &value))
+	{
+		// Min ms between messages to a subscriber
+		if (!enif_get_uint(env, value, &priv->notifyInterval))
+			return -1;
+	}
+	priv->timeInterval = TIME_INTERVAL;
+	priv->timeBytes = TIME_BYTES;
+	if (enif_get_map_value(env, info, atom_timeindex, &value))
+	{
+		// Ms between time checkpoints, 0 to disable
+		if (!enif_get_uint(env, value, &priv->timeInterval))
+			return -1;
+	}
+	if (enif_get_map_value(env, info, atom_timeindexmb, &value))
+	{
+		if (!enif_get_uint(env, value, &priv->timeBytes) || priv->timeBytes == 0 || priv->timeBytes >= 4096)
+			return -1;
+		priv->timeBytes *= 1024*1024;
+	}
+	priv->maxHandles = OPEN_HANDLES;
+	if (enif_get_map_value(env, info, atom_handles, &value))
+	{
+		if (!enif_get_int(env, value, &priv->maxHandles) || priv->maxHandles < 0)
+			return -1;
+	}
+	if (enif_get_map_value(env, info, atom_prealloc, &value))
+	{
+		if (!enif_get_int(env, value, &priv->prealloc))
+			return -1;
+	}
+	if (enif_get_map_value(env, info, atom_prezero, &value))
+	{
+		if (!enif_get_int(env, value, &priv->prezero))
+			return -1;
+	}
 	if (enif_get_map_value(env, info, atom_startindex, &value))
 	{
 		// if (!enif_get_int64(env,value,(ErlNifSInt64*)&logIndex))
@@ -926,6 +2621,11 @@ static int on_load(ErlNifEnv* env, void** priv_out, ERL_NIF_TERM info)
 			return -1;
 		}
 	}
+	if (priv->nPaths > MAX_PATHS)
+	{
+		DBG("Too many paths");
+		return -1;
+	}
 	if (priv->nPaths != nrecycle)
 	{
 		DBG("Recycle tuple must be as large as path tuple");
@@ -946,11 +2646,56 @@ static int on_load(ErlNifEnv* env, void** priv_out, ERL_NIF_TERM info)
 	priv->tasks = calloc(priv->nPaths*priv->nThreads,sizeof(queue*));
 	priv->syncTasks = calloc(priv->nPaths,sizeof(queue*));
 	priv->wtids = calloc(priv->nPaths*priv->nThreads, sizeof(ErlNifTid));
+	priv->wlatency = calloc(priv->nPaths*priv->nThreads, sizeof(u64));
 	priv->stids = calloc(priv->nPaths, sizeof(ErlNifTid));
+	priv->ptids = calloc(priv->nPaths, sizeof(ErlNifTid));
 	priv->paths = calloc(priv->nPaths*priv->nThreads, sizeof(char*));
 	priv->headFile = calloc(priv->nPaths, sizeof(qfile*));
 	priv->tailFile = calloc(priv->nPaths, sizeof(qfile*));
 	priv->recycle = calloc(priv->nPaths, sizeof(recq*));
+	priv->nRecycle = calloc(priv->nPaths, sizeof(int));
+	priv->recycleMtx = calloc(priv->nPaths, sizeof(ErlNifMutex*));
+	priv->recycleCond = calloc(priv->nPaths, sizeof(ErlNifCond*));
+	priv->retain = calloc(priv->nPaths, sizeof(retention));
+	priv->subs = calloc(priv->nPaths, sizeof(subscriber*));
+	priv->subMtx = calloc(priv->nPaths, sizeof(ErlNifMutex*));
+	priv->io = calloc(priv->nPaths, sizeof(iosched));
+	priv->cpus = calloc(priv->nPaths, sizeof(int*));
+	priv->nCpus = calloc(priv->nPaths, sizeof(int));
+	priv->handleMtx = calloc(priv->nPaths, sizeof(ErlNifMutex*));
+	priv->lruHead = calloc(priv->nPaths, sizeof(qfile*));
+	priv->lruTail = calloc(priv->nPaths, sizeof(qfile*));
+	priv->nOpen = calloc(priv->nPaths, sizeof(int));
+	priv->writeAlign = calloc(priv->nPaths, sizeof(u32));
+	priv->fileLimit = calloc(priv->nPaths, sizeof(u64));
+	for (i = 0; i < priv->nPaths; i++)
+	{
+		u64 rate = 0, iops = 0;
+		if (!get_segment_opts(env, info, i, priv))
+		{
+			DBG("Invalid filelimit or align for path %d", i);
+			return -1;
+		}
+		// Bytes/s and operations/s limits of path, integer or tuple for every path.
+		if (!get_path_opt(env, info, atom_iorate, i, &rate) ||
+			!get_path_opt(env, info, atom_iops, i, &iops))
+		{
+			DBG("Invalid iorate or iops for path %d", i);
+			return -1;
+		}
+		iosched_init(&priv->io[i], rate, iops);
+		priv->recycleMtx[i] = enif_mutex_create("recyclemtx");
+		priv->recycleCond[i] = enif_cond_create("recyclecond");
+		priv->handleMtx[i] = enif_mutex_create("handlemtx");
+		priv->subMtx[i] = enif_mutex_create("submtx");
+		atomic_init(&priv->retain[i].minIndex, -1);
+		if (enif_get_map_value(env, info, atom_retention, &value) && 
+			!get_retention(env, value, &priv->retain[i]))
+		{
+			DBG("Invalid retention");
+			return -1;
+		}
+	}
 	// priv->frwMtx = calloc(priv->nPaths, sizeof(ErlNifMutex*));
 
 	for (i = 0; i < priv->nPaths; i++)
@@ -977,6 +2722,7 @@ static int on_load(ErlNifEnv* env, void** priv_out, ERL_NIF_TERM info)
 			DBG("Adding to recycle list: %s",nr->name);
 			nr->next = pathRec;
 			pathRec = nr;
+			priv->nRecycle[i]++;
 		}
 		priv->recycle[i] = pathRec;
 
@@ -989,7 +2735,14 @@ static int on_load(ErlNifEnv* env, void** priv_out, ERL_NIF_TERM info)
 			DBG("Path too long");
 			return -1;
 		}
+		if (!get_path_cpus(env, info, i, priv))
+		{
+			DBG("Invalid cpus for path %d", i);
+			return -1;
+		}
 
+		replay_journals(i, logIndex, priv);
+		add_spares(i, priv);
 		if (open_file(logIndex, i, priv) == NULL)
 			return -1;
 		priv->tailFile[i] = priv->headFile[i];
@@ -1007,13 +2760,27 @@ static int on_load(ErlNifEnv* env, void** priv_out, ERL_NIF_TERM info)
 			return -1;
 		}
 
+		if (priv->prealloc > 0)
+		{
+			inf = calloc(1,sizeof(thrinf));
+			inf->pathIndex = i;
+			inf->pd = priv;
+			if (enif_thread_create("prepthr", &(priv->ptids[i]), pthread_prealloc, inf, NULL) != 0)
+			{
+				return -1;
+			}
+		}
+
 		for (j = 0; j < priv->nThreads; j++)
 		{
-			int index = i * priv->nPaths + j;
+			int index = i * priv->nThreads + j;
 			inf = calloc(1,sizeof(thrinf));
 			inf->windex = j;
 			inf->pathIndex = i;
-			priv->tasks[index] = inf->tasks = queue_create();
+			if (priv->ringSize && priv->nSch)
+				priv->tasks[index] = inf->tasks = queue_create_rings(priv->nSch, priv->ringSize);
+			else
+				priv->tasks[index] = inf->tasks = queue_create();
 			inf->pd = priv;
 			inf->curFile = priv->tailFile[i];
 			inf->env = enif_alloc_env();
@@ -1037,6 +2804,17 @@ static void on_unload(ErlNifEnv* env, void* pd)
 	qitem *item;
 	db_command *cmd = NULL;
 
+	priv->stopping = 1;
+	for (i = 0; i < priv->nPaths; i++)
+	{
+		if (!priv->ptids[i])
+			continue;
+		enif_mutex_lock(priv->recycleMtx[i]);
+		enif_cond_broadcast(priv->recycleCond[i]);
+		enif_mutex_unlock(priv->recycleMtx[i]);
+		enif_thread_join((ErlNifTid)priv->ptids[i],NULL);
+	}
+
 	for (i = 0; i < priv->nPaths; i++)
 	{
 		if (!priv->stids[i])
@@ -1068,11 +2846,25 @@ static void on_unload(ErlNifEnv* env, void* pd)
 		while (f != NULL)
 		{
 			qfile *fc = f;
+			f = f->next;
+			close_handles(i, fc, priv);
 			enif_mutex_destroy(fc->getMtx);
-			close(fc->fd);
+			free_times(fc);
+			free_journal(fc, priv->nSch);
+			free(fc->indexes);
+			free(fc->indexSizes);
 			free(fc);
-			f = f->next;
 		}
+		enif_mutex_destroy(priv->handleMtx[i]);
+		free(priv->cpus[i]);
+		iosched_destroy(&priv->io[i]);
+		while (priv->subs[i])
+		{
+			subscriber *s = priv->subs[i];
+			priv->subs[i] = s->next;
+			free(s);
+		}
+		enif_mutex_destroy(priv->subMtx[i]);
 	}
 
 	for (i = 0; i < priv->nPaths; i++)
@@ -1084,6 +2876,8 @@ static void on_unload(ErlNifEnv* env, void* pd)
 			r = r->next;
 			free(rtmp);
 		}
+		enif_mutex_destroy(priv->recycleMtx[i]);
+		enif_cond_destroy(priv->recycleCond[i]);
 	}
 
 	for (i = 0; i < priv->nSch; i++)
@@ -1101,10 +2895,27 @@ static void on_unload(ErlNifEnv* env, void* pd)
 	free(priv->tasks);
 	free(priv->syncTasks);
 	free(priv->wtids);
+	free(priv->wlatency);
 	free(priv->stids);
+	free(priv->ptids);
 	free(priv->headFile);
 	free(priv->tailFile);
 	free(priv->recycle);
+	free(priv->nRecycle);
+	free(priv->recycleMtx);
+	free(priv->recycleCond);
+	free(priv->retain);
+	free(priv->subs);
+	free(priv->subMtx);
+	free(priv->io);
+	free(priv->cpus);
+	free(priv->nCpus);
+	free(priv->handleMtx);
+	free(priv->lruHead);
+	free(priv->lruTail);
+	free(priv->nOpen);
+	free(priv->writeAlign);
+	free(priv->fileLimit);
 	free(priv);
 
 #ifdef _TESTDBG_
@@ -1114,17 +2925,29 @@ static void on_unload(ErlNifEnv* env, void* pd)
 
 static ErlNifFunc nif_funcs[] = {
 	{"open", 2, q_open},
+	{"open", 3, q_open},
 	{"stage_map", 4, q_stage_map},
 	{"stage_data", 3, q_stage_data},
 	{"stage_flush", 1, q_flush},
 	{"write", 5, q_write},
+	{"write_batch", 6, q_write_batch},
 	{"set_tunnel_connector",0,q_set_tunnel_connector},
 	{"set_thread_fd",4,q_set_thread_fd},
 	{"replicate_opts",3,q_replicate_opts},
 	{"init_tls",1,q_init_tls},
 	{"index_events",5,q_index_events},
+	{"index_events_batch",1,q_index_events_batch},
 	{"inject",4,q_inject},
 	{"fsync",3,q_fsync},
+	{"set_retention",2,q_set_retention},
+	{"verify_segment",3,q_verify_segment,DIRTY_IO},
+	{"subscribe",5,q_subscribe},
+	{"read_range",4,q_read_range},
+	{"decode",2,q_decode},
+	{"find_evnum",4,q_find_evnum,DIRTY_IO},
+	{"segment_evnums",2,q_segment_evnums,DIRTY_IO},
+	{"seek_time",2,q_seek_time,DIRTY_IO},
+	{"unsubscribe",2,q_unsubscribe},
 	// {"stop",0,q_stop},
 	// {"term_store"}
 };
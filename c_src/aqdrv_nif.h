@@ -6,6 +6,9 @@
 #include "lz4frame.h"
 #include "lz4.h"
 #include "lfqueue.h"
+#include "iosched.h"
+#include "record.h"
+#include "xxhash.h"
 #include "art.h"
 #include "lmdb.h"
 
@@ -19,6 +22,7 @@
 #endif
 #ifndef  _WIN32
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -34,16 +38,52 @@
 #endif
 
 
+// Default segment size and record alignment, both can be set per path.
 #define FILE_LIMIT 1024*1024*1024UL
 #define HDRMAX 512
 #define MAX_WRITES 1024
 #define MAX_WTHREADS 6
+// Paths written by a connection since fsync are a bitmask.
+#define MAX_PATHS 32
 #define MAX_CONNECTIONS 8
 #define IOV_START_AT 4
-// Every new write is aligned to this.
+// Every new write is aligned to this. Smaller alignment means packed
+// mode where every record starts with 4 byte LE length of record.
 #define WRITE_ALIGNMENT 512
+#define IS_PACKED(A) ((A) < WRITE_ALIGNMENT)
 #define PGSZ 4096
+// Most threads verify_segment will use.
+#define MAX_VERIFY_THREADS 16
+// Default ms and bytes between time checkpoints of a writer.
+#define TIME_INTERVAL 1000
+#define TIME_BYTES 16*1024*1024
+// Time checkpoints of a writer in a segment are kept in chunks of TIME_CHECKPOINTS.
+// Every full chunk doubles the spacing of checkpoints in the next one.
+#define TIME_CHECKPOINTS 1024
+#define TIME_CHUNKS 16
+// Default minimum ms between high-water mark messages to a subscriber.
+#define NOTIFY_INTERVAL 10
+// Largest cpu set a path can be pinned to.
+#define MAX_CPUS 1024
+// Default alignment of buffers and writes with O_DIRECT.
+#define DIRECT_ALIGNMENT 4096
+// How many retired segments are kept for reuse. Others are deleted.
+#define MAX_RECYCLE 4
+// How many sealed segments per path keep fd, mapping and index open.
+#define OPEN_HANDLES 4
 #define PATH_MAX 256
+// Staging more than this many bytes at once is moved to a dirty scheduler.
+#define DIRTY_THRESHOLD 256*1024
+
+// Dirty schedulers are always present from OTP 20 (NIF 2.11), before that
+// only if emulator was built with them.
+#if ERL_NIF_MAJOR_VERSION > 2 || (ERL_NIF_MAJOR_VERSION == 2 && ERL_NIF_MINOR_VERSION >= 11) || defined(ERL_NIF_DIRTY_SCHEDULER_SUPPORT)
+#define DIRTY_CPU ERL_NIF_DIRTY_JOB_CPU_BOUND
+#define DIRTY_IO ERL_NIF_DIRTY_JOB_IO_BOUND
+#else
+#define DIRTY_CPU 0
+#define DIRTY_IO 0
+#endif
 extern FILE *g_log;
 #if defined(_TESTDBG_)
 #ifndef _WIN32
@@ -69,14 +109,19 @@ extern ERL_NIF_TERM atom_compr;
 extern ERL_NIF_TERM atom_tcpfail;
 extern ERL_NIF_TERM atom_drivername;
 extern ERL_NIF_TERM atom_again;
+extern ERL_NIF_TERM atom_wait;
+extern ERL_NIF_TERM atom_hwm;
 extern ERL_NIF_TERM atom_schedulers;
 extern ErlNifResourceType *connection_type;
+extern ErlNifResourceType *segment_type;
 
 #define INDEX_FLAG_NOTERM 0
 
 typedef struct indexitem
 {
 	u32 nPos;
+	// Positions before nUsed are set, in order they were added.
+	u32 nUsed;
 	u32 *positions;
 	// Used in replication event items
 	u64 firstTerm;
@@ -87,13 +132,54 @@ typedef struct indexitem
 	// cons *consumers;
 }indexitem;
 
+// Named db of index with replication events ordered by (actor, evnum).
+// Key is <<NameLen:16, Name/binary, Evnum:64>>, value <<Evterm:64, Pos:32>>, all big endian.
+// Key <<0:16>> holds <<MinEvnum:64, MaxEvnum:64>> of segment.
+// Main db keys are event names, so name starts with a byte they are unlikely to.
+#define EVNUM_DB "\xff" "evnum"
+// Named db of time checkpoints. Key is <<Time:64>> (ms), value <<Pos:64>>:
+// every record before Pos was reserved before Time.
+#define TIME_DB "\xff" "time"
+
 typedef struct mdbinf
 {
 	MDB_env *env;
 	MDB_txn *txn;
 	MDB_dbi db;
+	MDB_dbi evdb;
+	MDB_dbi timedb;
+	u8 hasEvdb;
+	u8 hasTimedb;
+	// Used while index is created.
+	u64 minEvnum;
+	u64 maxEvnum;
+	int rc;
 }mdbinf;
 
+typedef struct timecp
+{
+	u64 time;
+	u64 pos;
+} timecp;
+// Checkpoint I of writer W. Chunks never move once allocated.
+#define TIMECP(F,W,I) (F)->times[W][(I) / TIME_CHECKPOINTS][(I) % TIME_CHECKPOINTS]
+
+// Index updates of a scheduler not yet written to segment index journal.
+typedef struct ijournal
+{
+	ErlNifMutex *mtx;
+	u8 *buf;
+	u32 size;
+	u32 cap;
+} ijournal;
+
+typedef enum
+{
+	jentry_event = 0,
+	jentry_repl = 1,
+	jentry_rewind = 2
+} jentry_type;
+
 typedef struct qfile
 {
 	ErlNifMutex *getMtx;
@@ -109,15 +195,42 @@ typedef struct qfile
 	// for every write thread what was last full byte. 
 	// Written to on write threads, read by sync thread.
 	_Atomic(i64) thrPositions[MAX_WTHREADS];
+	// for every write thread start of write in progress, INT64_MAX if none.
+	// Everything below the lowest one has been written.
+	_Atomic(i64) thrReserved[MAX_WTHREADS];
 	// for sync thread to keep track of progress
 	// and what requires syncing. It is a copy of thrPositions
 	// at the time of last sync.
 	u32 syncPositions[MAX_WTHREADS];
+	// For every write thread time checkpoints, added by writer and read by anyone
+	// up to nTimes. Ordered by time. Table of TIME_CHUNKS chunks, use TIMECP.
+	struct timecp **times[MAX_WTHREADS];
+	_Atomic(u32) nTimes[MAX_WTHREADS];
+	// Time of first checkpoint (erlang system time in ms).
+	_Atomic(u64) firstTime;
 	// Index for every scheduler.
 	art_tree *indexes;
 	u32 *indexSizes;
+	// For every scheduler, updates to indexes. Sync thread appends them to
+	// .ijournal after data is synced, so index survives a crash before create_index.
+	ijournal *journal;
+	int jfd;
 	i64 logIndex;
+	// Wall clock seconds when sync thread finished with file.
+	u64 sealedAt;
+	// How far sync thread has prefaulted wmap.
+	u64 faultedTo;
+	// Readers using file handles, file is not closed while > 0.
+	_Atomic(int) readRefs;
+	// LRU of open sealed files.
+	struct qfile *lruPrev;
+	struct qfile *lruNext;
 	int fd;
+	// Opened with O_DIRECT in wmode_direct, otherwise -1.
+	int dfd;
+	// wmode_mmap writes go to wmap. Only if blocks of file were allocated,
+	// a store into a hole on a full disk is SIGBUS.
+	u8 mapWrites;
 
 	struct qfile *next;
 }qfile;
@@ -128,6 +241,41 @@ typedef struct recq
 	struct recq *next;
 }recq;
 
+// Process that gets {aqdrv_hwm, PathIndex, LogIndex, Pos} when records
+// land before that position. Unsafe subscribers do not wait for sync.
+typedef struct subscriber
+{
+	ErlNifPid pid;
+	i64 logIndex;
+	u64 pos;
+	u64 lastSent;
+	u8 unsafe;
+	struct subscriber *next;
+}subscriber;
+
+// When sealed segments of a path are retired into recycle list.
+// 0 or -1 for a policy that is not used.
+typedef struct retention
+{
+	// Total size of sealed segments.
+	_Atomic(u64) maxBytes;
+	// Seconds since segment was sealed.
+	_Atomic(u64) maxAge;
+	// All consumers are past this log index.
+	_Atomic(i64) minIndex;
+}retention;
+
+// How writer threads write to segments.
+typedef enum
+{
+	// pwritev through page cache, sync thread flushes with sync_file_range.
+	wmode_pwrite = 0,
+	// Record is assembled into an aligned buffer and written with O_DIRECT.
+	wmode_direct = 1,
+	// Record is copied into wmap, sync thread flushes with msync.
+	wmode_mmap = 2
+} write_mode;
+
 typedef struct priv_data
 {
 	int nPaths;
@@ -137,15 +285,58 @@ typedef struct priv_data
 	qfile **headFile;
 	qfile **tailFile;
 	recq **recycle;
+	int *nRecycle;
+	ErlNifMutex **recycleMtx;
+	// Signalled when a file is taken from recycle list or on stop.
+	ErlNifCond **recycleCond;
+	retention *retain;
+	// How many preallocated spare segments to keep in recycle list.
+	int prealloc;
+	// Should spare segments be written with zeros, so that extents are
+	// already written and not just allocated.
+	int prezero;
+	_Atomic(u8) stopping;
+	write_mode wmode;
+	// Alignment of buffers in wmode_direct.
+	u32 dalign;
+	// For every path. Records are padded and positioned to multiples of writeAlign.
+	u32 *writeAlign;
+	u64 *fileLimit;
+	// Bytes of segment mapping to prefault ahead of writers.
+	u32 prefault;
+	// For every path, LRU of sealed files with open handles.
+	ErlNifMutex **handleMtx;
+	qfile **lruHead;
+	qfile **lruTail;
+	int *nOpen;
+	int maxHandles;
+	// Move connections between paths by queue depth and write latency.
+	u8 striping;
+	// For every writer, EWMA of write time in ns.
+	_Atomic(u64) *wlatency;
+	// For every path, subscribers to new records.
+	subscriber **subs;
+	ErlNifMutex **subMtx;
+	u32 notifyInterval;
+	// Writers add time checkpoint every timeInterval ms or timeBytes written.
+	u32 timeInterval;
+	u32 timeBytes;
+	// For every path, I/O rate limits.
+	iosched *io;
+	// For every path, cpus its writer, sync and prealloc threads run on.
+	int **cpus;
+	int *nCpus;
 
 	char **paths;
 #ifndef _TESTAPP_
 	ErlNifTid *wtids;
 	ErlNifTid *stids;
+	ErlNifTid *ptids;
 	ErlNifPid tunnelConnector;
 #endif
 	intq **schQueues;
 	int nSch;
+	u32 ringSize;
 } priv_data;
 
 typedef struct thrinf
@@ -158,6 +349,15 @@ typedef struct thrinf
 	int socket_types[MAX_CONNECTIONS];
 	int windex;
 	int pathIndex;
+	// Last time checkpoint of writer.
+	qfile *cpFile;
+	u64 cpTime;
+	u64 cpPos;
+	// Aligned buffer for wmode_direct.
+	u8 *abuf;
+	u32 abufSize;
+	// Sync thread: oldest sealed segment that is not indexed yet.
+	qfile *indexFile;
 } thrinf;
 
 typedef struct lz4buf
@@ -174,6 +374,26 @@ typedef struct lz4buf
 	// u32 maxFrameSz;
 } lz4buf;
 
+// What protects a record against corruption. Set per connection.
+typedef enum
+{
+	// XXH64 trailer over record as written (compressed bytes).
+	integrity_record = 0,
+	// LZ4 content checksum over uncompressed data, empty trailer.
+	integrity_lz4 = 1,
+	// Empty trailer, for data that was verified upstream.
+	integrity_none = 2
+} integrity_mode;
+
+// Last write of connection on a path, checked by sync thread of that path.
+typedef struct conpath
+{
+	qfile *file;
+	i64 logIndex;
+	u32 wpos;
+	int windex;
+} conpath;
+
 typedef struct coninf
 {
 	ErlNifEnv *env;
@@ -181,15 +401,32 @@ typedef struct coninf
 	lz4buf map;
 	u8 *header;
 	qfile *lastFile;
-	LZ4F_decompressionContext_t dctx;
+	// lastFile may be retired once sync thread moves past it,
+	// only dereference if logIndex shows it is still open.
+	i64 lastLogIndex;
+	// Incremented on every write. With striping writes of a connection may
+	// be on different paths, seq orders them.
+	u64 seq;
+	// Last write on every path. Set by writer, read by sync thread of path.
+	conpath *pathWrites;
+	// Paths written since last fsync, bit per path index.
+	u32 syncPaths;
 	// Position of last write in file
 	u32 lastWpos;
 	u32 headerSize;
 	u32 replSize;
+	// Checksum frame appended to data iov when write is submitted.
+	u32 trailerSize;
+	u8 trailer[TRAILER_SIZE];
+	// XXH64 of data frame past its first 8 bytes, updated while staging.
+	XXH64_state_t dataHash;
+	// How much of data.buf is in dataHash, 0 if it was not started.
+	u32 dataHashed;
 	int thread;
 	u8 started;
 	u8 doReplicate;
 	u8 doCompr;
+	u8 integrity;
 	u8 fileRefc;
 	#ifndef _TESTAPP_
 	// Fixed part of packet prefix
@@ -221,11 +458,32 @@ typedef struct db_command
 	ERL_NIF_TERM arg2;
 	ERL_NIF_TERM arg3;
 	ERL_NIF_TERM arg4;
+	// inspected binary of arg, valid while item env holds arg
+	ErlNifBinary bin;
+	// cmd_write: seq of write, taken when it was submitted.
+	u64 seq;
+	// cmd_sync: paths that still have to sync connection writes.
+	u32 syncPaths;
 #endif
 } db_command;
 
 qfile *open_file(i64 logIndex, int pathIndex, priv_data *priv);
+void recycle_push(priv_data *priv, int pathIndex, const char *name);
 void *wthread(void *arg);
 void *sthread(void *arg);
+void *pthread_prealloc(void *arg);
+void reset_con(coninf *con);
+int file_acquire(int pathIndex, qfile *f, priv_data *pd);
+void file_release(qfile *f);
+qfile *file_get(int pathIndex, i64 logIndex, priv_data *pd);
+qfile *file_get_time(int pathIndex, u64 time, priv_data *pd);
+u64 time_pos(qfile *f, u64 time, int nThreads);
+void free_times(qfile *f);
+void free_journal(qfile *f, int nSch);
+void create_index(int pathIndex, qfile *curFile, priv_data *pd);
+u64 written_hwm(qfile *f, int nThreads);
+void close_handles(int pathIndex, qfile *f, priv_data *pd);
+mdbinf *index_open(int pathIndex, i64 logIndex, priv_data *pd);
+void index_close(mdbinf *m);
 
 #endif
@@ -6,14 +6,14 @@
 // Sync threads also create the lmdb index file.
 
 
-static void reset_con(coninf *con)
+void reset_con(coninf *con)
 {
 	con->data.iovUsed = IOV_START_AT;
-	con->map.bufSize = con->data.bufSize = 0;
 	con->map.uncomprSz = con->data.uncomprSz = 0;
 	con->map.writeSize = con->data.writeSize = 0;
-	con->headerSize = con->replSize = 0;
+	con->headerSize = con->replSize = con->trailerSize = 0;
 	con->started = 0;
+	con->dataHashed = 0;
 	enif_clear_env(con->env);
 }
 
@@ -27,16 +27,70 @@ static void fail_send(int i, thrinf *thr)
 	enif_clear_env(thr->env);
 }
 
-static int do_pwrite(thrinf *data, coninf *con, u32 writePos)
+// O_DIRECT requires aligned memory, position and length. Copy record into
+// aligned buffer and zero padding up to reserved size.
+static int write_direct(thrinf *data, IOV *iov, int iovcnt, u32 size, u32 writePos)
 {
-	int rc = 0, i = 0;
+	const u32 align = data->pd->dalign;
+	u32 pos = 0;
+	int i;
+
+	if (data->abufSize < size)
+	{
+		free(data->abuf);
+		data->abufSize = size;
+		if (posix_memalign((void**)&data->abuf, align, size) != 0)
+		{
+			data->abuf = NULL;
+			data->abufSize = 0;
+			return -1;
+		}
+	}
+	for (i = 0; i < iovcnt && pos < size; i++)
+	{
+		const u32 len = MIN(iov[i].iov_len, size - pos);
+		memcpy(data->abuf + pos, iov[i].iov_base, len);
+		pos += len;
+	}
+	memset(data->abuf + pos, 0, size - pos);
+	return pwrite(data->curFile->dfd, data->abuf, size, writePos);
+}
+
+// No syscall, record is copied into segment mapping. Padding is left as is,
+// same as with pwritev. Never writes past reserved size.
+static int write_mmap(thrinf *data, IOV *iov, int iovcnt, u32 size, u32 writePos)
+{
+	u8 *dst = data->curFile->wmap + writePos;
+	u32 rc = 0;
+	int i;
+
+	for (i = 0; i < iovcnt && rc < size; i++)
+	{
+		const u32 len = MIN(iov[i].iov_len, size - rc);
+		copy_nt(dst + rc, iov[i].iov_base, len);
+		rc += len;
+	}
+	return rc;
+}
+
+// injected - size of binary added to iov by inject
+static int do_pwrite(thrinf *data, coninf *con, u32 writePos, u32 size, u32 injected)
+{
+	int rc = 0, i = 0, first = 1;
 	u8 bufSize[4];
+	u8 recLen[4];
 	IOV *iov = con->data.iov;
-	u32 entireLen = con->replSize + con->headerSize + con->map.writeSize + con->data.writeSize;
+	u32 entireLen = con->replSize + con->headerSize + con->map.writeSize + 
+		con->data.writeSize + con->trailerSize + injected;
 
-	writeUint32(bufSize, entireLen);
-
-	IOV_SET(iov[0],bufSize, sizeof(bufSize));
+	// In packed mode records are not on a fixed grid, they are prefixed with length
+	// so that reader can move to next record.
+	if (IS_PACKED(data->pd->writeAlign[data->pathIndex]))
+	{
+		writeUint32LE(recLen, entireLen - con->replSize);
+		IOV_SET(iov[0], recLen, sizeof(recLen));
+		first = 0;
+	}
 	IOV_SET(iov[1],con->header + con->replSize, con->headerSize);
 	IOV_SET(iov[2],con->map.buf, con->map.writeSize);
 	if (con->doCompr)
@@ -49,14 +103,22 @@ static int do_pwrite(thrinf *data, coninf *con, u32 writePos)
 		IOV_SET(iov[3], con->data.buf, 8);
 	}
 
+	if (data->curFile->dfd >= 0)
+		rc = write_direct(data, &iov[first], con->data.iovUsed - first, size, writePos);
+	else if (data->curFile->mapWrites)
+		rc = write_mmap(data, &iov[first], con->data.iovUsed - first, size, writePos);
+	else
 #if defined(__linux__)
-	rc = pwritev(data->curFile->fd, &iov[1], con->data.iovUsed - 1, writePos);
+	rc = pwritev(data->curFile->fd, &iov[first], con->data.iovUsed - first, writePos);
 #else
 	lseek(data->curFile->fd, writePos, SEEK_SET);
-	rc = writev(data->curFile->fd, &iov[1], con->data.iovUsed -1);
+	rc = writev(data->curFile->fd, &iov[first], con->data.iovUsed - first);
 #endif
 	DBG("WRITEV! %d pos=%u",rc, writePos);
 
+	writeUint32(bufSize, entireLen);
+	IOV_SET(iov[0],bufSize, sizeof(bufSize));
+
 	if (con->doReplicate)
 	{
 		iov[1].iov_base = con->header;
@@ -87,20 +149,63 @@ static int do_pwrite(thrinf *data, coninf *con, u32 writePos)
 	return rc;
 }
 
+// Allocate blocks for entire file, so writes do not need to.
+// Returns 0 if file is only extended and may be sparse.
+static int prealloc_file(int fd, u64 size)
+{
+#if defined(__linux__)
+	if (fallocate(fd, 0, 0, size) == 0)
+		return 1;
+	DBG("fallocate failed %d", errno);
+#endif
+	ftruncate(fd, size);
+	return 0;
+}
+
+// Second descriptor for wmode_direct writes, fd remains for mmap and sync.
+// If filesystem does not support O_DIRECT, file is written through page cache.
+static int open_direct(const char *filename, priv_data *priv)
+{
+	int fd = -1;
+	if (priv->wmode != wmode_direct)
+		return -1;
+#if defined(__linux__)
+	fd = open(filename, O_RDWR | O_DIRECT);
+#elif defined(__APPLE__)
+	fd = open(filename, O_RDWR);
+	if (fd >= 0)
+		fcntl(fd, F_NOCACHE, 1);
+#endif
+	if (fd < 0)
+	{
+		DBG("O_DIRECT open failed %d, using page cache", errno);
+		return -1;
+	}
+	return fd;
+}
+
 qfile *open_file(i64 logIndex, int pathIndex, priv_data *priv)
 {
 	char oldName[PATH_MAX];
 	char filename[PATH_MAX];
 	int i;
 	qfile *file = calloc(1, sizeof(qfile));
-	recq *recycle = priv->recycle[pathIndex];
+	recq *recycle;
 	sprintf(filename, "%s/%lld.q",priv->paths[pathIndex], (long long int)logIndex);
+	enif_mutex_lock(priv->recycleMtx[pathIndex]);
+	recycle = priv->recycle[pathIndex];
+	if (recycle != NULL)
+	{
+		priv->recycle[pathIndex] = recycle->next;
+		priv->nRecycle[pathIndex]--;
+		enif_cond_signal(priv->recycleCond[pathIndex]);
+	}
+	enif_mutex_unlock(priv->recycleMtx[pathIndex]);
 	if (recycle != NULL)
 	{
 		snprintf(oldName, sizeof(oldName), "%s/%s",priv->paths[pathIndex], recycle->name);
 		DBG("Using recycle! %s",oldName);
 		rename(oldName, filename);
-		priv->recycle[pathIndex] = recycle->next;
 		free(recycle);
 	}
 	else
@@ -110,8 +215,15 @@ qfile *open_file(i64 logIndex, int pathIndex, priv_data *priv)
 	file->fd = open(filename, O_CREAT|O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP);
 	if (file->fd > 0)
 	{
-		ftruncate(file->fd, FILE_LIMIT);
-		file->wmap = mmap(NULL, FILE_LIMIT, PROT_WRITE | PROT_READ, MAP_SHARED, file->fd, 0);
+		const int allocated = prealloc_file(file->fd, priv->fileLimit[pathIndex]);
+		file->wmap = mmap(NULL, priv->fileLimit[pathIndex], PROT_WRITE | PROT_READ, MAP_SHARED, file->fd, 0);
+		if (file->wmap == MAP_FAILED)
+			file->wmap = NULL;
+		else
+			madvise(file->wmap, priv->fileLimit[pathIndex], MADV_SEQUENTIAL);
+		// Without allocated blocks a full disk is a write error, not SIGBUS.
+		file->mapWrites = priv->wmode == wmode_mmap && file->wmap && allocated;
+		file->dfd = open_direct(filename, priv);
 	}
 	else
 	{
@@ -121,16 +233,104 @@ qfile *open_file(i64 logIndex, int pathIndex, priv_data *priv)
 	}
 	file->indexes = calloc(priv->nSch, sizeof(art_tree));
 	file->indexSizes = calloc(priv->nSch, sizeof(u32));
+	file->journal = calloc(priv->nSch, sizeof(ijournal));
+	for (i = 0; i < priv->nSch; i++)
+		file->journal[i].mtx = enif_mutex_create("journalmtx");
+	file->jfd = -1;
 	file->getMtx = enif_mutex_create("getmtx");
 	file->logIndex = logIndex;
 	for (i = 0; i < priv->nThreads; i++)
+	{
 		atomic_init(&file->thrPositions[i],0);
+		atomic_init(&file->thrReserved[i],INT64_MAX);
+		atomic_init(&file->nTimes[i],0);
+	}
+	atomic_init(&file->firstTime, 0);
 	atomic_init(&file->reservePos, 0);
 	atomic_init(&file->writeRefs, 0);
 	priv->headFile[pathIndex] = file;
 	return file;
 }
 
+// Add file name (relative to path) to recycle list.
+void recycle_push(priv_data *priv, int pathIndex, const char *name)
+{
+	recq *nr = calloc(1,sizeof(recq));
+	snprintf(nr->name, sizeof(nr->name), "%s", name);
+	enif_mutex_lock(priv->recycleMtx[pathIndex]);
+	nr->next = priv->recycle[pathIndex];
+	priv->recycle[pathIndex] = nr;
+	priv->nRecycle[pathIndex]++;
+	enif_mutex_unlock(priv->recycleMtx[pathIndex]);
+}
+
+// Keeps priv->prealloc spare segments in recycle list of a path,
+// so that new segments never start as fresh files.
+void *pthread_prealloc(void *arg)
+{
+	thrinf *data = (thrinf*)arg;
+	priv_data *pd = data->pd;
+	const int pi = data->pathIndex;
+	const u64 limit = pd->fileLimit[pi];
+	u32 counter = 0;
+	u8 *zeros = NULL;
+
+	pin_thread(pd->cpus[pi], pd->nCpus[pi]);
+	if (pd->prezero)
+		zeros = calloc(1, 1024*1024);
+
+	while (1)
+	{
+		char nameOnly[20];
+		char name[PATH_MAX];
+		int fd;
+
+		enif_mutex_lock(pd->recycleMtx[pi]);
+		while (!pd->stopping && pd->nRecycle[pi] >= pd->prealloc)
+			enif_cond_wait(pd->recycleCond[pi], pd->recycleMtx[pi]);
+		enif_mutex_unlock(pd->recycleMtx[pi]);
+		if (pd->stopping)
+			break;
+
+		// Unique across restarts, names from previous run may be in recycle list.
+		// Picked up by add_spares on next load.
+		snprintf(nameOnly, sizeof(nameOnly), "p%x_%u.r", (u32)time(NULL), counter++);
+		snprintf(name, sizeof(name), "%s/%s", pd->paths[pi], nameOnly);
+		fd = open(name, O_CREAT|O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP);
+		if (fd < 0)
+		{
+			DBG("Unable to create spare segment %s", name);
+			break;
+		}
+		prealloc_file(fd, limit);
+		if (zeros)
+		{
+			u64 pos;
+			for (pos = 0; pos < limit && !pd->stopping; pos += 1024*1024)
+			{
+				const u32 sz = MIN(1024*1024, limit - pos);
+				iosched_acquire(&pd->io[pi], io_background, sz);
+				if (pwrite(fd, zeros, sz, pos) != sz)
+					break;
+			}
+		}
+		fdatasync(fd);
+		close(fd);
+		if (pd->stopping)
+		{
+			// Zeroing was cut short.
+			if (zeros)
+				unlink(name);
+			break;
+		}
+		DBG("Spare segment ready %s", name);
+		recycle_push(pd, pi, nameOnly);
+	}
+	free(zeros);
+	free(data);
+	return NULL;
+}
+
 static void move_forward(thrinf *data)
 {
 	qfile *curFile = data->curFile;
@@ -151,43 +351,198 @@ static void move_forward(thrinf *data)
 	enif_mutex_unlock(curFile->getMtx);
 }
 
+// Time is taken after position was reserved, so every record before pos
+// was reserved before time.
+// Chunks are added, never moved, so readers need no lock. A writer that stays
+// on a segment for long gets sparser checkpoints instead of none.
+static void add_checkpoint(thrinf *data, qfile *f, u64 pos)
+{
+	priv_data *pd = data->pd;
+	const int w = data->windex;
+	const u32 n = atomic_load_explicit(&f->nTimes[w], memory_order_relaxed);
+	const u32 chunk = n / TIME_CHECKPOINTS;
+	u64 now, first;
+
+	if (!pd->timeInterval || chunk == TIME_CHUNKS)
+		return;
+	now = enif_monotonic_time(ERL_NIF_MSEC) + enif_time_offset(ERL_NIF_MSEC);
+	if (data->cpFile == f && now - data->cpTime < ((u64)pd->timeInterval << chunk) &&
+		pos - data->cpPos < ((u64)pd->timeBytes << chunk))
+		return;
+	if (!f->times[w])
+		f->times[w] = calloc(TIME_CHUNKS, sizeof(timecp*));
+	if (!f->times[w][chunk])
+		f->times[w][chunk] = malloc(TIME_CHECKPOINTS * sizeof(timecp));
+	TIMECP(f, w, n).time = now;
+	TIMECP(f, w, n).pos = pos;
+	// Also publishes a new chunk pointer.
+	atomic_store_explicit(&f->nTimes[w], n + 1, memory_order_release);
+	first = atomic_load(&f->firstTime);
+	while ((first == 0 || now < first) && !atomic_compare_exchange_weak(&f->firstTime, &first, now))
+		;
+	data->cpFile = f;
+	data->cpTime = now;
+	data->cpPos = pos;
+}
+
+// Highest checkpoint position at or before time, 0 if there is none.
+// Checkpoints of a writer are ordered, so every writer is a binary search.
+u64 time_pos(qfile *f, u64 time, int nThreads)
+{
+	u64 pos = 0;
+	int w;
+
+	for (w = 0; w < nThreads; w++)
+	{
+		const u32 n = atomic_load_explicit(&f->nTimes[w], memory_order_acquire);
+		u32 lo = 0, hi = n;
+		while (lo < hi)
+		{
+			const u32 mid = lo + (hi - lo) / 2;
+			if (TIMECP(f, w, mid).time <= time)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo > 0 && TIMECP(f, w, lo-1).pos > pos)
+			pos = TIMECP(f, w, lo-1).pos;
+	}
+	return pos;
+}
+
+void free_times(qfile *f)
+{
+	int i, j;
+	for (i = 0; i < MAX_WTHREADS; i++)
+	{
+		if (!f->times[i])
+			continue;
+		for (j = 0; j < TIME_CHUNKS; j++)
+			free(f->times[i][j]);
+		free(f->times[i]);
+		f->times[i] = NULL;
+	}
+}
+
+void free_journal(qfile *f, int nSch)
+{
+	int i;
+	if (f->jfd >= 0)
+		close(f->jfd);
+	f->jfd = -1;
+	if (!f->journal)
+		return;
+	for (i = 0; i < nSch; i++)
+	{
+		enif_mutex_destroy(f->journal[i].mtx);
+		free(f->journal[i].buf);
+	}
+	free(f->journal);
+	f->journal = NULL;
+}
+
+// Swap journal buffers of every scheduler with empty ones in taken.
+// Every update taken refers to a write that has already completed.
+static u32 journal_take(qfile *f, int nSch, ijournal *taken)
+{
+	u32 total = 0;
+	int i;
+
+	for (i = 0; i < nSch; i++)
+	{
+		ijournal *j = &f->journal[i];
+		u8 *buf;
+		u32 cap;
+		if (!j->size)
+			continue;
+		enif_mutex_lock(j->mtx);
+		buf = j->buf;
+		cap = j->cap;
+		j->buf = taken[i].buf;
+		j->cap = taken[i].cap;
+		taken[i].buf = buf;
+		taken[i].cap = cap;
+		taken[i].size = j->size;
+		j->size = 0;
+		enif_mutex_unlock(j->mtx);
+		total += taken[i].size;
+	}
+	return total;
+}
+
+// Append taken updates to journal of file, once data they point to is synced.
+static void journal_write(thrinf *data, qfile *f, ijournal *taken)
+{
+	priv_data *pd = data->pd;
+	int i;
+
+	if (f->jfd < 0)
+	{
+		char name[PATH_MAX];
+		snprintf(name, sizeof(name), "%s/%lld.ijournal", pd->paths[data->pathIndex], (long long int)f->logIndex);
+		f->jfd = open(name, O_CREAT|O_WRONLY|O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP);
+	}
+	for (i = 0; i < pd->nSch; i++)
+	{
+		if (taken[i].size && f->jfd >= 0)
+		{
+			if (write(f->jfd, taken[i].buf, taken[i].size) != taken[i].size)
+				DBG("Journal write failed %d", errno);
+		}
+		taken[i].size = 0;
+	}
+	if (f->jfd >= 0)
+		fdatasync(f->jfd);
+}
+
 static u32 reserve_write(thrinf *data, qitem *item, u32 *pSzOut, u64 *diff)
 {
 	qfile *curFile = data->curFile;
-	u64 writePos = FILE_LIMIT;
+	const u64 limit = data->pd->fileLimit[data->pathIndex];
+	u64 writePos = limit;
 	u32 size;
+	const u32 align = data->pd->writeAlign[data->pathIndex];
 	const db_command *cmd = (db_command*)item->cmd;
 	coninf *con = cmd->conn;
+	// Injected binary is in iov after staged buffers.
+	const u32 injected = cmd->type == cmd_inject ? cmd->bin.size : 0;
 
-	size = con->data.writeSize + con->map.writeSize + con->headerSize;
+	size = con->data.writeSize + con->map.writeSize + con->headerSize + con->trailerSize + injected;
+	if (IS_PACKED(align))
+		size += 4;
 
-	if (size > WRITE_ALIGNMENT)
+	if (size > align)
 	{
-		if (size % WRITE_ALIGNMENT)
-			size += (WRITE_ALIGNMENT - (size % WRITE_ALIGNMENT));
+		if (size % align)
+			size += (align - (size % align));
 	}
 	else
-		size = WRITE_ALIGNMENT;
+		size = align;
 	*pSzOut = size;
 
 	// printf("writing %d from=%lld\r\n",data->windex, curFile->logIndex);
 
 	while (1)
 	{
+		// Lower bound of writePos visible before reservePos moves.
+		atomic_store(&curFile->thrReserved[data->windex], atomic_load(&curFile->reservePos));
 		writePos = atomic_fetch_add(&curFile->reservePos, size);
-		if ((writePos + size) < FILE_LIMIT)
+		if ((writePos + size) < limit)
 		{
+			atomic_store(&curFile->thrReserved[data->windex], writePos);
 			break;
 		}
 		else
 		{
+			atomic_store(&curFile->thrReserved[data->windex], INT64_MAX);
 			move_forward(data);
 			curFile = data->curFile;
 			DBG("Moving? curfile=%lld", curFile->logIndex);
 		}
 	}
 
-	if (do_pwrite(data, con, writePos) == -1)
+	iosched_acquire(&data->pd->io[data->pathIndex], io_write, size);
+	if (do_pwrite(data, con, writePos, size, injected) == -1)
 		return ~0;
 
 	// if (endPos % (1024*1024*10) == 0)
@@ -199,7 +554,13 @@ static u32 reserve_write(thrinf *data, qitem *item, u32 *pSzOut, u64 *diff)
 		con->fileRefc = 0;
 	}
 	con->lastFile = curFile;
+	con->lastLogIndex = curFile->logIndex;
 	con->lastWpos = writePos;
+	con->pathWrites[data->pathIndex].file = curFile;
+	con->pathWrites[data->pathIndex].logIndex = curFile->logIndex;
+	con->pathWrites[data->pathIndex].wpos = writePos;
+	con->pathWrites[data->pathIndex].windex = data->windex;
+	con->syncPaths |= 1u << data->pathIndex;
 	// If we are still holding ref to this file keep it.
 	// If we are not holding ref take it.
 	if (!con->fileRefc)
@@ -208,6 +569,8 @@ static u32 reserve_write(thrinf *data, qitem *item, u32 *pSzOut, u64 *diff)
 	}
 	con->fileRefc = 1;
 	atomic_store(&curFile->thrPositions[data->windex], writePos+size);
+	atomic_store(&curFile->thrReserved[data->windex], INT64_MAX);
+	add_checkpoint(data, curFile, writePos);
 
 	return writePos;
 }
@@ -275,6 +638,78 @@ static void respond_cmd(thrinf *data, qitem *item)
 	queue_recycle(item);
 }
 
+// Every byte of file below this has been written.
+// Capped at end of last finished write. reservePos also counts the reservation
+// that did not fit at end of segment, data past last record there is left over
+// from previous use of a recycled file.
+u64 written_hwm(qfile *f, int nThreads)
+{
+	i64 hwm = atomic_load(&f->reservePos);
+	i64 end = 0;
+	int i;
+	for (i = 0; i < nThreads; i++)
+	{
+		const i64 r = atomic_load(&f->thrReserved[i]);
+		if (r < hwm)
+			hwm = r;
+	}
+	// After thrReserved, writer sets thrPositions before it clears its reservation.
+	for (i = 0; i < nThreads; i++)
+	{
+		const i64 p = atomic_load(&f->thrPositions[i]);
+		if (p > end)
+			end = p;
+	}
+	return MIN(hwm, end);
+}
+
+// Tell subscribers that are behind where file has been written (or synced if durable).
+// Messages to a subscriber are at most one per notifyInterval, a skipped update
+// is sent on next call.
+static void notify_subs(thrinf *data, qfile *f, u64 hwm, int durable)
+{
+	priv_data *pd = data->pd;
+	const int pi = data->pathIndex;
+	subscriber *s, **prev;
+	u64 now;
+
+	if (!pd->subs[pi] || !hwm)
+		return;
+	// Failed reservations at end of file move reservePos past it.
+	hwm = MIN(hwm, pd->fileLimit[pi]);
+	// Writers do not wait on each other for this.
+	if (enif_mutex_trylock(pd->subMtx[pi]) != 0)
+		return;
+	now = enif_monotonic_time(ERL_NIF_MSEC);
+	prev = &pd->subs[pi];
+	while ((s = *prev) != NULL)
+	{
+		if ((durable || s->unsafe) &&
+			(s->logIndex < f->logIndex || (s->logIndex == f->logIndex && s->pos < hwm)) &&
+			now - s->lastSent >= pd->notifyInterval)
+		{
+			ERL_NIF_TERM msg = enif_make_tuple4(data->env, atom_hwm,
+				enif_make_int(data->env, pi),
+				enif_make_int64(data->env, f->logIndex),
+				enif_make_uint64(data->env, hwm));
+			if (!enif_send(NULL, &s->pid, data->env, msg))
+			{
+				// Process is gone
+				*prev = s->next;
+				free(s);
+				enif_clear_env(data->env);
+				continue;
+			}
+			enif_clear_env(data->env);
+			s->logIndex = f->logIndex;
+			s->pos = hwm;
+			s->lastSent = now;
+		}
+		prev = &s->next;
+	}
+	enif_mutex_unlock(pd->subMtx[pi]);
+}
+
 static ERL_NIF_TERM do_write(thrinf *data, qitem *item)
 {
 	u32 writePos, szOut;
@@ -289,11 +724,34 @@ static ERL_NIF_TERM do_write(thrinf *data, qitem *item)
 	NANODIFF(stop, start, diff);
 	// cmd->answer = enif_make_uint(item->env, resp);
 
+	if (data->pd->striping)
+	{
+		const int index = data->pathIndex * data->pd->nThreads + data->windex;
+		const u64 lat = atomic_load_explicit(&data->pd->wlatency[index], memory_order_relaxed);
+		atomic_store_explicit(&data->pd->wlatency[index], (lat * 7 + diff) / 8, memory_order_relaxed);
+	}
+
+	if (writePos != ~0 && data->pd->subs[data->pathIndex])
+	{
+		qfile *f = data->curFile;
+		notify_subs(data, f, written_hwm(f, data->pd->nThreads), 0);
+	}
+
 	if (writePos == ~0)
 	{
 		DBG("Write failed!");
 		return atom_false;
 	}
+	else if (data->pd->striping)
+	{
+		const db_command *cmd = (db_command*)item->cmd;
+		return enif_make_tuple5(item->env, 
+		enif_make_uint(item->env, writePos),
+		enif_make_uint(item->env, szOut),
+		enif_make_uint64(item->env, diff),
+		enif_make_int(item->env, data->pathIndex),
+		enif_make_uint64(item->env, cmd->seq));
+	}
 	else
 	{
 		return enif_make_tuple3(item->env, 
@@ -307,16 +765,13 @@ static ERL_NIF_TERM do_write(thrinf *data, qitem *item)
 
 static ERL_NIF_TERM do_inject(thrinf *data, qitem *item)
 {
-	ErlNifBinary bin;
 	const db_command *cmd = (db_command*)item->cmd;
+	const ErlNifBinary bin = cmd->bin;
 	u32 writePos, szOut;
 	coninf *con = cmd->conn;
 	const u8 doRepl = con->doReplicate;
 	const u8 doCompr = con->doCompr;
 
-	if (!enif_inspect_binary(item->env, cmd->arg, &bin))
-		return atom_false;
-
 	// bin contains all data. Header, map and body. 
 	// We set doCompr=1 so that do_pwrite leaves any buffers alone for iov elements
 	// before IOV_START_AT.
@@ -342,6 +797,8 @@ void *wthread(void *arg)
 {
 	u8 stop = 0;
 	thrinf* data = (thrinf*)arg;
+
+	pin_thread(data->pd->cpus[data->pathIndex], data->pd->nCpus[data->pathIndex]);
 	// TIME syncSent;
 	// GETTIME(syncSent);
 
@@ -383,6 +840,7 @@ void *wthread(void *arg)
 
 	enif_free_env(data->env);
 	queue_destroy(data->tasks);
+	free(data->abuf);
 	free(data);
 	return NULL;
 }
@@ -393,6 +851,7 @@ static int open_env(mdbinf *lm, const char *pth, int flags, u32 size)
 
 	if ((rc = mdb_env_create(&lm->env)) != MDB_SUCCESS)
 		return rc;
+	mdb_env_set_maxdbs(lm->env, 2);
 	if (size > 0)
 	{
 		if (mdb_env_set_mapsize(lm->env,size) != MDB_SUCCESS)
@@ -404,10 +863,66 @@ static int open_env(mdbinf *lm, const char *pth, int flags, u32 size)
 		return rc;
 	if ((rc = mdb_dbi_open(lm->txn, NULL, 0, &lm->db)) != MDB_SUCCESS)
 		return rc;
+	// Indexes written before evnum db existed do not have it.
+	lm->hasEvdb = mdb_dbi_open(lm->txn, EVNUM_DB, 
+		(flags & MDB_RDONLY) ? 0 : MDB_CREATE, &lm->evdb) == MDB_SUCCESS;
+	lm->hasTimedb = mdb_dbi_open(lm->txn, TIME_DB, 
+		(flags & MDB_RDONLY) ? 0 : MDB_CREATE, &lm->timedb) == MDB_SUCCESS;
+	if (flags & MDB_RDONLY)
+	{
+		// Commit so dbi handles can be used by lookups in their own txns.
+		if ((rc = mdb_txn_commit(lm->txn)) != MDB_SUCCESS)
+		{
+			lm->txn = NULL;
+			return rc;
+		}
+		if ((rc = mdb_txn_begin(lm->env, NULL, flags, &lm->txn)) != MDB_SUCCESS)
+			return rc;
+	}
 
 	return 0;
 }
 
+// Entries of replication events of actor into evnum db.
+static int evnum_to_lmdb(mdbinf *m, const unsigned char *key, uint32_t key_len, indexitem *it)
+{
+	u8 *kbuf;
+	u8 vbuf[12];
+	MDB_val k, v;
+	u32 i;
+	int rc = 0;
+
+	if (key_len > 0xFFFF)
+		return 0;
+	kbuf = malloc(2 + key_len + 8);
+	kbuf[0] = (u8)(key_len >> 8);
+	kbuf[1] = (u8)key_len;
+	memcpy(kbuf + 2, key, key_len);
+	k.mv_data = kbuf;
+	k.mv_size = 2 + key_len + 8;
+	v.mv_data = vbuf;
+	v.mv_size = sizeof(vbuf);
+	for (i = 0; i < it->nUsed; i++)
+	{
+		const u64 evterm = it->firstTerm + it->termEvnum[i*2];
+		const u64 evnum = it->firstEvnum + it->termEvnum[i*2+1];
+
+		writeUint32(kbuf + 2 + key_len, (u32)(evnum >> 32));
+		writeUint32(kbuf + 2 + key_len + 4, (u32)evnum);
+		writeUint32(vbuf, (u32)(evterm >> 32));
+		writeUint32(vbuf + 4, (u32)evterm);
+		writeUint32(vbuf + 8, it->positions[i]);
+		if ((rc = mdb_put(m->txn, m->evdb, &k, &v, 0)) != MDB_SUCCESS)
+			break;
+		if (evnum < m->minEvnum)
+			m->minEvnum = evnum;
+		if (evnum > m->maxEvnum)
+			m->maxEvnum = evnum;
+	}
+	free(kbuf);
+	return rc;
+}
+
 static int index_to_lmdb(void *data, const unsigned char *key, uint32_t key_len, void *value)
 {
 	mdbinf *m = (mdbinf*)data;
@@ -415,11 +930,8 @@ static int index_to_lmdb(void *data, const unsigned char *key, uint32_t key_len,
 	u32 i;
 	int rc;
 	MDB_val k, v;
-	for (i = 0; i < it->nPos; i++)
-	{
-		if (it->positions[i] == (u32)~0)
-			break;
-	}
+
+	i = it->nUsed;
 	if (!i)
 		return 0;
 	k.mv_size = key_len;
@@ -444,6 +956,8 @@ static int index_to_lmdb(void *data, const unsigned char *key, uint32_t key_len,
 			offset += sizeof(u64);
 			memcpy(v.mv_data + offset, it->termEvnum, i*sizeof(u32)*2);
 		}
+		if (it->termEvnum && m->hasEvdb)
+			return evnum_to_lmdb(m, key, key_len, it);
 		// if ((i = mdb_put(m->txn, m->db, &k, &v, MDB_NOOVERWRITE)) != MDB_SUCCESS)
 		// {
 		// 	// It seems art_iter can visit key twice...
@@ -457,43 +971,125 @@ static int index_to_lmdb(void *data, const unsigned char *key, uint32_t key_len,
 	return 0;
 }
 
-static int cleanup_index(void *data, const unsigned char *key, uint32_t key_len, void *value)
+// Write item to lmdb and free it. Called for every item of a consumed index,
+// once a write fails the rest are only freed.
+static int export_index(void *data, const unsigned char *key, uint32_t key_len, void *value)
 {
+	mdbinf *m = (mdbinf*)data;
 	indexitem *it = (indexitem*)value;
+	int rc = 0;
+
+	if (m->rc == 0)
+		rc = m->rc = index_to_lmdb(data, key, key_len, value);
 	free(it->positions);
 	free(it->termEvnum);
 	free(it);
-	return 0;
+	return rc;
 }
 
-static void create_index(int pathIndex, qfile *curFile, priv_data *pd)
+static int cmp_time(const void *a, const void *b)
+{
+	const timecp *x = (const timecp*)a;
+	const timecp *y = (const timecp*)b;
+	return x->time < y->time ? -1 : (x->time > y->time);
+}
+
+// Checkpoints of all writers in time order. Value of every time is highest
+// position before it, so a seek to last time before T gives a position.
+static int times_to_lmdb(mdbinf *m, qfile *f, int nThreads)
+{
+	timecp *all;
+	u32 n = 0, i;
+	u64 pos = 0;
+	int w, rc = 0;
+
+	for (w = 0; w < nThreads; w++)
+		n += atomic_load(&f->nTimes[w]);
+	if (!n)
+		return 0;
+	all = malloc(n * sizeof(timecp));
+	n = 0;
+	for (w = 0; w < nThreads; w++)
+	{
+		const u32 nw = atomic_load(&f->nTimes[w]);
+		for (i = 0; i < nw; i += TIME_CHECKPOINTS)
+			memcpy(all + n + i, f->times[w][i / TIME_CHECKPOINTS],
+				MIN(TIME_CHECKPOINTS, nw - i) * sizeof(timecp));
+		n += nw;
+	}
+	qsort(all, n, sizeof(timecp), cmp_time);
+	for (i = 0; i < n; i++)
+	{
+		u8 kbuf[8], vbuf[8];
+		MDB_val k = {sizeof(kbuf), kbuf}, v = {sizeof(vbuf), vbuf};
+
+		pos = MAX(pos, all[i].pos);
+		writeUint32(kbuf, (u32)(all[i].time >> 32));
+		writeUint32(kbuf + 4, (u32)all[i].time);
+		writeUint32(vbuf, (u32)(pos >> 32));
+		writeUint32(vbuf + 4, (u32)pos);
+		if ((rc = mdb_put(m->txn, m->timedb, &k, &v, 0)) != MDB_SUCCESS)
+			break;
+	}
+	free(all);
+	return rc;
+}
+
+// Estimate of how much create_index writes.
+static u32 index_size(qfile *f, priv_data *pd)
 {
-	int i;
 	u32 indexSize = 0;
+	int i;
+
+	for (i = 0; i < pd->nSch; i++)
+		indexSize += f->indexSizes[i];
+	// Time checkpoints and pages of named dbs.
+	for (i = 0; i < pd->nThreads; i++)
+		indexSize += atomic_load(&f->nTimes[i]) * 16;
+	return indexSize + 2*PGSZ;
+}
+
+void create_index(int pathIndex, qfile *curFile, priv_data *pd)
+{
+	int i;
+	const u32 indexSize = index_size(curFile, pd);
 	mdbinf *m = calloc(1, sizeof(mdbinf));
 	char name[256];
 
 	sprintf(name, "%s/%lld.index", pd->paths[pathIndex], curFile->logIndex);
-	for (i = 0; i < pd->nSch; i++)
-		indexSize += curFile->indexSizes[i];
 	open_env(m, name, 0, indexSize*3);
+	m->minEvnum = UINT64_MAX;
+	m->maxEvnum = 0;
 	// printf("Index size=%u, path=%s\r\n",indexSize,name);
+	// Single pass over every scheduler index, trees are freed as they are written.
 	for (i = 0; i < pd->nSch; i++)
 	{
 		art_tree *index = &curFile->indexes[i];
 		if (index->root)
-		{
-			// printf("Iterate sched indexues=%d\r\n",i);
-			if (art_iter(index, index_to_lmdb, m) != 0)
-			{
-				// printf("Iter error\r\n");
-				mdb_txn_abort(m->txn);
-				mdb_env_close(m->env);
-				unlink(name);
-				free(m);
-				return;
-			}
-		}
+			art_iter_bulk(index, export_index, m, 1);
+	}
+	if (m->rc != 0)
+	{
+		// printf("Iter error\r\n");
+		mdb_txn_abort(m->txn);
+		mdb_env_close(m->env);
+		unlink(name);
+		free(m);
+		return;
+	}
+	if (m->hasTimedb)
+		times_to_lmdb(m, curFile, pd->nThreads);
+	if (m->hasEvdb && m->minEvnum <= m->maxEvnum)
+	{
+		u8 kbuf[2] = {0,0};
+		u8 vbuf[16];
+		MDB_val k = {sizeof(kbuf), kbuf}, v = {sizeof(vbuf), vbuf};
+
+		writeUint32(vbuf, (u32)(m->minEvnum >> 32));
+		writeUint32(vbuf + 4, (u32)m->minEvnum);
+		writeUint32(vbuf + 8, (u32)(m->maxEvnum >> 32));
+		writeUint32(vbuf + 12, (u32)m->maxEvnum);
+		mdb_put(m->txn, m->evdb, &k, &v, 0);
 	}
 	if ((i = mdb_txn_commit(m->txn)) != MDB_SUCCESS)
 	{
@@ -506,19 +1102,434 @@ static void create_index(int pathIndex, qfile *curFile, priv_data *pd)
 	}
 	mdb_env_close(m->env);
 
+	// Index is complete, journal is not needed anymore.
+	if (curFile->jfd >= 0)
+		close(curFile->jfd);
+	curFile->jfd = -1;
+	sprintf(name, "%s/%lld.ijournal", pd->paths[pathIndex], (long long int)curFile->logIndex);
+	unlink(name);
+
+	sprintf(name, "%s/%lld.index", pd->paths[pathIndex], (long long int)curFile->logIndex);
 	memset(m, 0, sizeof(mdbinf));
-	if (open_env(m, name, MDB_RDONLY, 0) == 0)
+	if (open_env(m, name, MDB_RDONLY | MDB_NOTLS, 0) == 0)
 	{
-		curFile->mdb = m;
+		// Index may be created after segment was sealed and its handles closed,
+		// reopen_file will open env then.
+		enif_mutex_lock(pd->handleMtx[pathIndex]);
+		if (curFile->fd >= 0 && !curFile->mdb)
+			curFile->mdb = m;
+		else
+		{
+			mdb_txn_abort(m->txn);
+			mdb_env_close(m->env);
+			free(m);
+		}
+		enif_mutex_unlock(pd->handleMtx[pathIndex]);
 	}
+}
 
-	for (i = 0; i < pd->nSch; i++)
+// Index sealed segments when index class gets tokens. Sync thread never waits
+// for it, so sync replies are not held back by index writes.
+static void index_pending(thrinf *data, int force)
+{
+	priv_data *pd = data->pd;
+	const int pi = data->pathIndex;
+
+	while (data->indexFile != data->curFile)
 	{
-		art_tree *index = &curFile->indexes[i];
-		art_iter(index, cleanup_index, NULL);
-		art_tree_destroy(index);
-		curFile->indexes[i].root = NULL;
+		qfile *f = data->indexFile;
+		if (!force && !iosched_try(&pd->io[pi], io_index, index_size(f, pd)))
+			break;
+		create_index(pi, f, pd);
+		data->indexFile = f->next;
+	}
+}
+
+// Close a sealed segment, delete its index and move it to recycle list.
+// Sealed segments do not need fd, mapping or lmdb env unless something reads them.
+// Up to maxHandles per path are kept open in LRU order, others are closed and
+// reopened on file_acquire. Protected by handleMtx.
+void close_handles(int pathIndex, qfile *f, priv_data *pd)
+{
+	if (f->mdb)
+	{
+		index_close(f->mdb);
+		f->mdb = NULL;
 	}
+	if (f->wmap)
+	{
+		munmap(f->wmap, pd->fileLimit[pathIndex]);
+		f->wmap = NULL;
+		f->mapWrites = 0;
+	}
+	if (f->fd >= 0)
+		close(f->fd);
+	if (f->dfd >= 0)
+		close(f->dfd);
+	f->fd = f->dfd = -1;
+}
+
+static void lru_unlink(int pathIndex, qfile *f, priv_data *pd)
+{
+	if (f->lruPrev)
+		f->lruPrev->lruNext = f->lruNext;
+	else
+		pd->lruHead[pathIndex] = f->lruNext;
+	if (f->lruNext)
+		f->lruNext->lruPrev = f->lruPrev;
+	else
+		pd->lruTail[pathIndex] = f->lruPrev;
+	f->lruPrev = f->lruNext = NULL;
+	pd->nOpen[pathIndex]--;
+}
+
+static void lru_push(int pathIndex, qfile *f, priv_data *pd)
+{
+	f->lruPrev = NULL;
+	f->lruNext = pd->lruHead[pathIndex];
+	if (f->lruNext)
+		f->lruNext->lruPrev = f;
+	else
+		pd->lruTail[pathIndex] = f;
+	pd->lruHead[pathIndex] = f;
+	pd->nOpen[pathIndex]++;
+}
+
+// Close least recently used files that are not being read.
+static void lru_evict(int pathIndex, priv_data *pd)
+{
+	qfile *f = pd->lruTail[pathIndex];
+
+	while (f && pd->nOpen[pathIndex] > pd->maxHandles)
+	{
+		qfile *prev = f->lruPrev;
+		if (atomic_load(&f->readRefs) == 0)
+		{
+			lru_unlink(pathIndex, f, pd);
+			close_handles(pathIndex, f, pd);
+		}
+		f = prev;
+	}
+}
+
+// Open index of segment read only. Also used for segments of earlier runs
+// that are not in chain, but had their index created or replayed.
+mdbinf *index_open(int pathIndex, i64 logIndex, priv_data *pd)
+{
+	char name[PATH_MAX];
+	struct stat st;
+	mdbinf *m;
+
+	snprintf(name, sizeof(name), "%s/%lld.index", pd->paths[pathIndex], (long long int)logIndex);
+	// lmdb would create lock file of a missing index.
+	if (stat(name, &st) != 0)
+		return NULL;
+	m = calloc(1, sizeof(mdbinf));
+	if (!m)
+		return NULL;
+	if (open_env(m, name, MDB_RDONLY | MDB_NOTLS, 0) != 0)
+	{
+		if (m->env)
+			mdb_env_close(m->env);
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+void index_close(mdbinf *m)
+{
+	mdb_txn_abort(m->txn);
+	mdb_env_close(m->env);
+	free(m);
+}
+
+static int reopen_file(int pathIndex, qfile *f, priv_data *pd)
+{
+	char name[PATH_MAX];
+
+	snprintf(name, sizeof(name), "%s/%lld.q", pd->paths[pathIndex], (long long int)f->logIndex);
+	f->fd = open(name, O_RDONLY);
+	if (f->fd < 0)
+		return 0;
+	f->wmap = mmap(NULL, pd->fileLimit[pathIndex], PROT_READ, MAP_SHARED, f->fd, 0);
+	if (f->wmap == MAP_FAILED)
+	{
+		f->wmap = NULL;
+		close(f->fd);
+		f->fd = -1;
+		return 0;
+	}
+	madvise(f->wmap, pd->fileLimit[pathIndex], MADV_SEQUENTIAL);
+	f->mdb = index_open(pathIndex, f->logIndex, pd);
+	return 1;
+}
+
+static int acquire_locked(int pathIndex, qfile *f, priv_data *pd)
+{
+	int rc = 1;
+
+	if (f->sealedAt)
+	{
+		if (f->fd < 0)
+		{
+			rc = reopen_file(pathIndex, f, pd);
+			if (rc)
+				lru_push(pathIndex, f, pd);
+		}
+		else
+		{
+			lru_unlink(pathIndex, f, pd);
+			lru_push(pathIndex, f, pd);
+		}
+	}
+	if (rc)
+	{
+		atomic_fetch_add(&f->readRefs, 1);
+		lru_evict(pathIndex, pd);
+	}
+	return rc;
+}
+
+// Take a read reference to file, reopening it if it was closed.
+// Every successful call must be followed by file_release.
+int file_acquire(int pathIndex, qfile *f, priv_data *pd)
+{
+	int rc;
+
+	enif_mutex_lock(pd->handleMtx[pathIndex]);
+	rc = acquire_locked(pathIndex, f, pd);
+	enif_mutex_unlock(pd->handleMtx[pathIndex]);
+	return rc;
+}
+
+// Last file with first write at or before time, or first file if time is
+// before all of them. Takes a read reference to it.
+qfile *file_get_time(int pathIndex, u64 time, priv_data *pd)
+{
+	qfile *f, *found;
+
+	enif_mutex_lock(pd->handleMtx[pathIndex]);
+	found = pd->tailFile[pathIndex];
+	for (f = found; f; f = f->next)
+	{
+		const u64 first = atomic_load(&f->firstTime);
+		if (first && first <= time)
+			found = f;
+		else if (first > time)
+			break;
+	}
+	if (found && !acquire_locked(pathIndex, found, pd))
+		found = NULL;
+	enif_mutex_unlock(pd->handleMtx[pathIndex]);
+	return found;
+}
+
+// Find file of log index on path and take a read reference to it.
+// Files are retired from tail under handleMtx, so chain is safe to walk here.
+qfile *file_get(int pathIndex, i64 logIndex, priv_data *pd)
+{
+	qfile *f;
+
+	enif_mutex_lock(pd->handleMtx[pathIndex]);
+	for (f = pd->tailFile[pathIndex]; f; f = f->next)
+	{
+		if (f->logIndex == logIndex)
+		{
+			if (!acquire_locked(pathIndex, f, pd))
+				f = NULL;
+			break;
+		}
+	}
+	enif_mutex_unlock(pd->handleMtx[pathIndex]);
+	return f;
+}
+
+void file_release(qfile *f)
+{
+	atomic_fetch_sub(&f->readRefs, 1);
+}
+
+// File is synced and indexed, writers are done with it. Drop pages from
+// our address space and move it to LRU of sealed files.
+static void seal_file(int pathIndex, qfile *f, priv_data *pd)
+{
+	const u64 end = written_hwm(f, pd->nThreads);
+
+	// Recycled files have old records past end. Zeros after last record stop
+	// segment walker when segment is read from disk after restart.
+	if (f->fd >= 0 && end + 8 <= pd->fileLimit[pathIndex])
+	{
+		const u8 zeros[8] = {0};
+		if (pwrite(f->fd, zeros, sizeof(zeros), end) == sizeof(zeros))
+			fdatasync(f->fd);
+	}
+	enif_mutex_lock(pd->handleMtx[pathIndex]);
+	f->sealedAt = time(NULL);
+	if (f->dfd >= 0)
+	{
+		close(f->dfd);
+		f->dfd = -1;
+	}
+	if (f->wmap)
+		madvise(f->wmap, pd->fileLimit[pathIndex], MADV_DONTNEED);
+	lru_push(pathIndex, f, pd);
+	lru_evict(pathIndex, pd);
+	enif_mutex_unlock(pd->handleMtx[pathIndex]);
+}
+
+// File must be tail of chain, it is unlinked from it.
+// Returns 0 if file is still being read and can not be retired yet.
+static int retire_file(int pathIndex, qfile *f, priv_data *pd)
+{
+	char name[PATH_MAX];
+	char nameOnly[20];
+	int doRecycle;
+
+	enif_mutex_lock(pd->handleMtx[pathIndex]);
+	if (atomic_load(&f->readRefs) > 0)
+	{
+		enif_mutex_unlock(pd->handleMtx[pathIndex]);
+		return 0;
+	}
+	if (f->fd >= 0)
+	{
+		lru_unlink(pathIndex, f, pd);
+		close_handles(pathIndex, f, pd);
+	}
+	pd->tailFile[pathIndex] = f->next;
+	enif_mutex_unlock(pd->handleMtx[pathIndex]);
+
+	DBG("Retiring %lld", (long long int)f->logIndex);
+	snprintf(name, sizeof(name), "%s/%lld.index", pd->paths[pathIndex], (long long int)f->logIndex);
+	unlink(name);
+	snprintf(name, sizeof(name), "%s/%lld.index-lock", pd->paths[pathIndex], (long long int)f->logIndex);
+	unlink(name);
+	snprintf(name, sizeof(name), "%s/%lld.ijournal", pd->paths[pathIndex], (long long int)f->logIndex);
+	unlink(name);
+
+	enif_mutex_lock(pd->recycleMtx[pathIndex]);
+	doRecycle = pd->nRecycle[pathIndex] < MAX(MAX_RECYCLE, pd->prealloc);
+	enif_mutex_unlock(pd->recycleMtx[pathIndex]);
+
+	snprintf(name, sizeof(name), "%s/%lld.q", pd->paths[pathIndex], (long long int)f->logIndex);
+	if (doRecycle)
+	{
+		// Recycled files are .r, so they are not mistaken for segments after restart.
+		char rname[PATH_MAX];
+		snprintf(nameOnly, sizeof(nameOnly), "%lld.r", (long long int)f->logIndex);
+		snprintf(rname, sizeof(rname), "%s/%s", pd->paths[pathIndex], nameOnly);
+		if (rename(name, rname) == 0)
+			recycle_push(pd, pathIndex, nameOnly);
+		else
+			unlink(name);
+	}
+	else
+		unlink(name);
+
+	enif_mutex_destroy(f->getMtx);
+	free_times(f);
+	free_journal(f, pd->nSch);
+	free(f->indexes);
+	free(f->indexSizes);
+	free(f);
+	return 1;
+}
+
+// Retire sealed segments from tail of chain while any retention policy says so.
+// Files before sync thread indexFile are synced and indexed. Does not wait for
+// background tokens, it tries again on next round.
+static void do_retention(thrinf *data)
+{
+	priv_data *pd = data->pd;
+	const int pi = data->pathIndex;
+	retention *r = &pd->retain[pi];
+	const u64 maxBytes = atomic_load(&r->maxBytes);
+	const u64 maxAge = atomic_load(&r->maxAge);
+	const i64 minIndex = atomic_load(&r->minIndex);
+	const u64 now = time(NULL);
+	u64 total = 0;
+	qfile *f;
+
+	if (!maxBytes && !maxAge && minIndex < 0)
+		return;
+
+	for (f = pd->tailFile[pi]; f != data->curFile; f = f->next)
+		total += pd->fileLimit[pi];
+
+	while ((f = pd->tailFile[pi]) != data->indexFile)
+	{
+		if (!((maxBytes && total > maxBytes) ||
+			(maxAge && now - f->sealedAt > maxAge) ||
+			(minIndex >= 0 && f->logIndex < minIndex)))
+			break;
+		if (!iosched_try(&pd->io[pi], io_background, 0))
+			break;
+		if (!retire_file(pi, f, pd))
+			break;
+		total -= pd->fileLimit[pi];
+	}
+}
+
+// Map pages ahead of mmap writers, so they do not stall on page faults.
+// Populating for write dirties page cache, so it is only done when writers
+// store into the mapping anyway.
+static void prefault(thrinf *data, qfile *f)
+{
+	const u64 limit = data->pd->fileLimit[data->pathIndex];
+	u64 target = atomic_load_explicit(&f->reservePos, memory_order_relaxed) + data->pd->prefault;
+	u64 from = f->faultedTo;
+
+	if (!f->mapWrites)
+		return;
+	target = MIN(target, limit);
+	if (from >= target)
+		return;
+	from &= ~(u64)(PGSZ - 1);
+#if defined(MADV_POPULATE_WRITE)
+	// Content is not modified, but pages are marked dirty.
+	if (madvise(f->wmap + from, target - from, MADV_POPULATE_WRITE) != 0)
+#endif
+	{
+		// Read fault every page. Writing would race with writers.
+		volatile u8 sum = 0;
+		u64 pos;
+		madvise(f->wmap + from, target - from, MADV_WILLNEED);
+		for (pos = from; pos < target; pos += PGSZ)
+			sum += f->wmap[pos];
+		(void)sum;
+	}
+	f->faultedTo = target;
+}
+
+// Has last write of connection on this path been synced.
+static int con_synced(thrinf *data, coninf *con)
+{
+	const conpath *w = &con->pathWrites[data->pathIndex];
+
+	if (w->file == NULL)
+		return 1;
+	// Sync thread only moves past a file once it has been synced.
+	if (w->logIndex < data->curFile->logIndex)
+		return 1;
+	return w->wpos < w->file->syncPositions[w->windex];
+}
+
+// Connection is synced on this path. Sync command moves on to next path
+// connection wrote to, answer is sent once all of them are done.
+static void sync_done(thrinf *data, qitem *item)
+{
+	db_command *cmd = (db_command*)item->cmd;
+	priv_data *pd = data->pd;
+	int i;
+
+	cmd->syncPaths &= ~(1u << data->pathIndex);
+	for (i = 0; i < pd->nPaths; i++)
+	{
+		if ((cmd->syncPaths & (1u << i)) && queue_push(pd->syncTasks[i], item))
+			return;
+	}
+	respond_cmd(data, item);
 }
 
 #define S_MAX_WAIT 100
@@ -526,16 +1537,25 @@ void *sthread(void *arg)
 {
 	thrinf* data = (thrinf*)arg;
 	const int nThreads = data->pd->nThreads;
-	int twait = S_MAX_WAIT;
+	int twait = S_MAX_WAIT, sch;
+	qitem *itemsWaiting = NULL;
+	// Journal buffers taken from files, swapped back on next take.
+	ijournal *taken = calloc(MAX(1, data->pd->nSch), sizeof(ijournal));
 	INITTIME;
 
+	pin_thread(data->pd->cpus[data->pathIndex], data->pd->nCpus[data->pathIndex]);
+	if (!data->env)
+		data->env = enif_alloc_env();
+	data->indexFile = data->curFile;
+
 	while (1)
 	{
 		int i;
 		char threadsSeen = 0;
 		qfile *curFile = data->curFile;
+		qfile *hwmFile = NULL;
+		u64 durableHwm = 0;
 		db_command *cmd = NULL;
-		qitem *itemsWaiting = NULL;
 		qitem *item = queue_timepop(data->tasks,MIN(twait,50));
 		if (item != NULL)
 			cmd = (db_command*)item->cmd;
@@ -545,9 +1565,9 @@ void *sthread(void *arg)
 		if (cmd && cmd->conn)
 		{
 			cmd->answer = atom_ok;
-			if (cmd->conn->lastWpos < cmd->conn->lastFile->syncPositions[cmd->conn->thread])
+			if (con_synced(data, cmd->conn))
 			{
-				respond_cmd(data, item);
+				sync_done(data, item);
 				continue;
 			}
 		}
@@ -560,6 +1580,11 @@ void *sthread(void *arg)
 			long conRefs = atomic_load_explicit(&curFile->conRefs,memory_order_relaxed);
 			char curRefc = atomic_load_explicit(&curFile->writeRefs,memory_order_relaxed);
 			u32 curReservePos = atomic_load_explicit(&curFile->reservePos,memory_order_relaxed);
+			// Taken before thrPositions, so everything below it is in the range synced now
+			// or was synced before.
+			const u64 hwm = written_hwm(curFile, nThreads);
+			// Same for index updates.
+			const u32 journalSize = journal_take(curFile, data->pd->nSch, taken);
 			threadsSeen += curRefc;
 
 			for (i = 0; i < nThreads; i++)
@@ -582,7 +1607,20 @@ void *sthread(void *arg)
 				TIME start;
 				TIME stop;
 				u64 diff = 0;
+				// Bytes were charged as io_write, sync only counts as an operation.
+				iosched_charge(&data->pd->io[data->pathIndex], io_sync, 0);
 				GETTIME(start);
+				// With O_DIRECT data is already on device, only
+				// metadata (extent state, size) needs to be synced.
+				if (curFile->dfd >= 0)
+					fdatasync(curFile->fd);
+				else if (curFile->mapWrites)
+				{
+					// msync range must start on page boundary.
+					const u32 from = syncFrom & ~(PGSZ - 1);
+					msync(curFile->wmap + from, highestPos - from, MS_SYNC);
+				}
+				else
 				#if defined(__APPLE__) || defined(_WIN32)
 					fsync(curFile->fd);
 				#elif defined(__linux__)
@@ -611,6 +1649,13 @@ void *sthread(void *arg)
 			}
 			else
 				twait = S_MAX_WAIT;
+			if (journalSize)
+				journal_write(data, curFile, taken);
+			if (hwm > 0)
+			{
+				hwmFile = curFile;
+				durableHwm = hwm;
+			}
 
 			// printf("conrefs=%ld, curRefc=%d, posnow=%lld\r\n",
 			// 	conRefs, (int)curRefc, curFile->logIndex);
@@ -620,7 +1665,8 @@ void *sthread(void *arg)
 				// printf("Moving to next file conrefs=%ld, posnow=%lld\r\n",conRefs, curFile->logIndex);
 				if (!conRefs)
 				{
-					create_index(data->pathIndex, curFile, data->pd);
+					// Indexed later by index_pending.
+					seal_file(data->pathIndex, curFile, data->pd);
 					data->curFile = curFile = curFile->next;
 				}
 			}
@@ -641,6 +1687,9 @@ void *sthread(void *arg)
 				break;
 		}
 
+		if (hwmFile)
+			notify_subs(data, hwmFile, durableHwm, 1);
+
 		if (cmd && cmd->conn)
 		{
 			item->next = itemsWaiting;
@@ -661,9 +1710,8 @@ void *sthread(void *arg)
 				qitem *next = tmpItem->next;
 				db_command *tmpCmd = (db_command*)tmpItem->cmd;
 
-				// if (tmpCmd->conn->lastWpos < tmpCmd->conn->lastFile->syncPos)
-				if (tmpCmd->conn->lastWpos <= tmpCmd->conn->lastFile->syncPositions[cmd->conn->thread])
-					respond_cmd(data, tmpItem);
+				if (con_synced(data, tmpCmd->conn))
+					sync_done(data, tmpItem);
 				else
 				{
 					tmpItem->next = itemsWaiting;
@@ -673,10 +1721,23 @@ void *sthread(void *arg)
 			}
 		}
 
+		index_pending(data, 0);
+		do_retention(data);
+		if (data->pd->prefault && data->pd->wmode == wmode_mmap)
+		{
+			prefault(data, data->curFile);
+			if (data->curFile->next)
+				prefault(data, data->curFile->next);
+		}
+
 		if (cmd && cmd->type == cmd_stop)
 			break;
 	}
 	printf("sthread done\r\n");
+	index_pending(data, 1);
+	for (sch = 0; sch < data->pd->nSch; sch++)
+		free(taken[sch].buf);
+	free(taken);
 	if (data->env)
 		enif_free_env(data->env);
 	queue_destroy(data->tasks);
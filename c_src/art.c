@@ -818,6 +818,138 @@ int art_iter(art_tree *t, art_callback cb, void *data) {
     return recursive_iter(t->root, cb, data);
 }
 
+// Next child of n at or after *i in key order, *i is moved past it.
+// Prefetches the child after it so it is in cache once we get to it.
+static art_node* next_child(art_node *n, int *i) {
+    union {
+        art_node4 *p1;
+        art_node16 *p2;
+        art_node48 *p3;
+        art_node256 *p4;
+    } p;
+    art_node *c;
+    int idx;
+    switch (n->type) {
+        case NODE4:
+            p.p1 = (art_node4*)n;
+            if (*i >= n->num_children) return NULL;
+            c = p.p1->children[(*i)++];
+            if (*i < n->num_children)
+                __builtin_prefetch(LEAF_RAW(p.p1->children[*i]));
+            return c;
+
+        case NODE16:
+            p.p2 = (art_node16*)n;
+            if (*i >= n->num_children) return NULL;
+            c = p.p2->children[(*i)++];
+            if (*i < n->num_children)
+                __builtin_prefetch(LEAF_RAW(p.p2->children[*i]));
+            return c;
+
+        case NODE48:
+            p.p3 = (art_node48*)n;
+            for (; *i < 256; (*i)++) {
+                idx = p.p3->keys[*i];
+                if (!idx) continue;
+                (*i)++;
+                return p.p3->children[idx-1];
+            }
+            return NULL;
+
+        case NODE256:
+            p.p4 = (art_node256*)n;
+            for (; *i < 256; (*i)++) {
+                c = p.p4->children[*i];
+                if (!c) continue;
+                (*i)++;
+                return c;
+            }
+            return NULL;
+
+        default:
+            abort();
+    }
+}
+
+typedef struct {
+    art_node *n;
+    int i;
+} iter_frame;
+
+/**
+ * Iterates like art_iter, in key order, but with an explicit
+ * stack instead of recursion. Children are prefetched one ahead.
+ * If consume is set, every leaf and node is freed once visited and
+ * the tree is empty afterwards. In that mode iteration does not
+ * stop on a non-zero callback result, so the callback still gets
+ * to release every value.
+ * @arg t The tree to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @arg consume Free the tree while iterating
+ * @return 0 on success, or the first non-zero return of the callback.
+ */
+int art_iter_bulk(art_tree *t, art_callback cb, void *data, int consume) {
+    iter_frame stack[64];
+    iter_frame *s = stack;
+    int depth = 64, sp = 0, res = 0, r;
+    art_node *n = t->root;
+
+    if (!n) return 0;
+    if (IS_LEAF(n)) {
+        art_leaf *l = LEAF_RAW(n);
+        res = cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+        if (consume) {
+            free(l);
+            t->root = NULL;
+            t->size = 0;
+        }
+        return res;
+    }
+
+    s[sp].n = n;
+    s[sp++].i = 0;
+    while (sp) {
+        iter_frame *f = &s[sp-1];
+        art_node *c = next_child(f->n, &f->i);
+
+        if (!c) {
+            if (consume) free(f->n);
+            sp--;
+            continue;
+        }
+        if (IS_LEAF(c)) {
+            art_leaf *l = LEAF_RAW(c);
+            r = cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+            if (consume) {
+                free(l);
+                if (r && !res) res = r;
+            } else if (r) {
+                res = r;
+                break;
+            }
+            continue;
+        }
+        if (sp == depth) {
+            // Keys are long enough to go deeper than the stack on hand.
+            iter_frame *ns = malloc(depth * 2 * sizeof(iter_frame));
+            if (!ns) abort();
+            memcpy(ns, s, depth * sizeof(iter_frame));
+            if (s != stack) free(s);
+            s = ns;
+            depth *= 2;
+        }
+        s[sp].n = c;
+        s[sp++].i = 0;
+    }
+    if (s != stack) free(s);
+    if (consume) {
+        t->root = NULL;
+        t->size = 0;
+    }
+    return res;
+}
+
 /**
  * Checks if a leaf prefix matches
  * @return 0 on success.
@@ -183,6 +183,19 @@ art_leaf* art_maximum(art_tree *t);
  */
 int art_iter(art_tree *t, art_callback cb, void *data);
 
+/**
+ * Iterates like art_iter, in key order, without recursion and
+ * with child nodes prefetched. If consume is set, the tree is freed
+ * while iterating and is empty afterwards. Iteration then does not
+ * stop on a non-zero callback result, every value is still visited.
+ * @arg t The tree to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @arg consume Free the tree while iterating
+ * @return 0 on success, or the first non-zero return of the callback.
+ */
+int art_iter_bulk(art_tree *t, art_callback cb, void *data, int consume);
+
 /**
  * Iterates through the entries pairs in the map,
  * invoking a callback for each that matches a given prefix.
@@ -0,0 +1,123 @@
+#include "iosched.h"
+#include <time.h>
+#include <unistd.h>
+
+static u64 now_ns(void)
+{
+	TIME t;
+	GETTIME(t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Buckets hold 100ms worth of tokens, at least one 1MB write.
+void iosched_init(iosched *s, u64 rate, u64 iops)
+{
+	memset(s, 0, sizeof(iosched));
+	s->rate = rate;
+	s->iops = iops;
+	s->burst = rate / 10 > 1024*1024 ? rate / 10 : 1024*1024;
+	s->opsBurst = iops / 10 > 1 ? iops / 10 : 1;
+	s->tokens = s->burst;
+	s->opsTokens = s->opsBurst;
+	s->lastRefill = now_ns();
+	if (rate || iops)
+		s->mtx = enif_mutex_create("iosched");
+}
+
+void iosched_destroy(iosched *s)
+{
+	if (s->mtx)
+		enif_mutex_destroy(s->mtx);
+	s->mtx = NULL;
+}
+
+static void refill(iosched *s)
+{
+	const u64 now = now_ns();
+	const double sec = (now - s->lastRefill) / 1000000000.0;
+
+	s->lastRefill = now;
+	s->tokens += sec * s->rate;
+	if (s->tokens > s->burst)
+		s->tokens = s->burst;
+	s->opsTokens += sec * s->iops;
+	if (s->opsTokens > s->opsBurst)
+		s->opsTokens = s->opsBurst;
+}
+
+// Class may proceed if nothing more important waits and bucket is above
+// the share kept for classes before it. Foreground may go into debt, so a
+// write larger than bucket is not stuck forever.
+static int may_go(iosched *s, io_class cls)
+{
+	int i;
+	for (i = 0; i < cls; i++)
+	{
+		if (s->waiting[i])
+			return 0;
+	}
+	if (s->rate && s->tokens <= s->burst * cls / 4)
+		return 0;
+	if (s->iops && s->opsTokens <= s->opsBurst * cls / 4)
+		return 0;
+	return 1;
+}
+
+// Block until class can do an operation of bytes. 
+void iosched_acquire(iosched *s, io_class cls, u64 bytes)
+{
+	if (s->mtx == NULL)
+		return;
+
+	enif_mutex_lock(s->mtx);
+	s->waiting[cls]++;
+	while (1)
+	{
+		double missing;
+		refill(s);
+		if (may_go(s, cls))
+			break;
+		// Sleep roughly until there are enough tokens again.
+		missing = s->rate ? (s->burst * cls / 4 - s->tokens) / s->rate : 0.001;
+		enif_mutex_unlock(s->mtx);
+		usleep(missing > 0.001 ? (missing < 0.1 ? missing * 1000000 : 100000) : 1000);
+		enif_mutex_lock(s->mtx);
+	}
+	s->waiting[cls]--;
+	s->tokens -= bytes;
+	s->opsTokens -= 1;
+	enif_mutex_unlock(s->mtx);
+}
+
+// Non blocking acquire, for threads that must not wait.
+// Returns 1 and takes tokens if class can go now.
+int iosched_try(iosched *s, io_class cls, u64 bytes)
+{
+	int ok;
+	if (s->mtx == NULL)
+		return 1;
+
+	enif_mutex_lock(s->mtx);
+	refill(s);
+	ok = may_go(s, cls);
+	if (ok)
+	{
+		s->tokens -= bytes;
+		s->opsTokens -= 1;
+	}
+	enif_mutex_unlock(s->mtx);
+	return ok;
+}
+
+// Take tokens without waiting, for operations that have to happen anyway.
+void iosched_charge(iosched *s, io_class cls, u64 bytes)
+{
+	if (s->mtx == NULL)
+		return;
+
+	enif_mutex_lock(s->mtx);
+	refill(s);
+	s->tokens -= bytes;
+	s->opsTokens -= 1;
+	enif_mutex_unlock(s->mtx);
+}
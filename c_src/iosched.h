@@ -0,0 +1,40 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include "erl_nif.h"
+#include "platform.h"
+
+// Token bucket I/O scheduler, one per path.
+// Lower class goes first. Higher classes only get tokens when nothing
+// below them is waiting and bucket is above their reserve.
+typedef enum
+{
+	io_write = 0,
+	io_sync = 1,
+	io_index = 2,
+	io_background = 3
+} io_class;
+#define IO_CLASSES 4
+
+typedef struct iosched
+{
+	ErlNifMutex *mtx;
+	// Bytes/s and operations/s. 0 is unlimited.
+	u64 rate;
+	u64 iops;
+	// Bucket sizes
+	double burst;
+	double opsBurst;
+	double tokens;
+	double opsTokens;
+	u64 lastRefill;
+	int waiting[IO_CLASSES];
+} iosched;
+
+void iosched_init(iosched *s, u64 rate, u64 iops);
+void iosched_destroy(iosched *s);
+void iosched_acquire(iosched *s, io_class cls, u64 bytes);
+int iosched_try(iosched *s, io_class cls, u64 bytes);
+void iosched_charge(iosched *s, io_class cls, u64 bytes);
+
+#endif
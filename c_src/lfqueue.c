@@ -3,6 +3,19 @@
 #include "lfqueue.h"
 #include <sched.h>
 #define BLOCK_SIZE 1024
+// Reuse queue grows by BLOCK_SIZE items when empty, up to this many blocks.
+#define MAX_BLOCKS 16
+// Consumer spin bounds before parking.
+#define SPIN_MIN 64
+#define SPIN_MAX 16384
+
+#if defined(__linux__)
+#define PARK(Q,T) FUTEX_WAIT((Q)->sleeping, 1, T)
+#define UNPARK(Q) FUTEX_WAKE((Q)->sleeping)
+#else
+#define PARK(Q,T) ((T) == (uint32_t)~0 ? SEM_WAIT((Q)->sem) : SEM_TIMEDWAIT((Q)->sem, T))
+#define UNPARK(Q) SEM_POST((Q)->sem)
+#endif
 
 #ifdef _WIN32
 #define __thread __declspec( thread )
@@ -10,6 +23,8 @@
 
 static __thread intq *tls_reuseq = NULL;
 static __thread uint64_t tls_qsize = 0;
+// Which ring of a queue this thread produces into. -1 if none.
+static __thread int tls_ring = -1;
 
 // MPSC lock free queue based on
 // http://www.1024cores.net/home/lock-free-algorithms/queues/non-intrusive-mpsc-node-based-queue
@@ -21,6 +36,10 @@ static void initq(intq *q)
 
 	atomic_store(&q->head, stub);
 	q->tail = stub;
+	#ifndef _TESTAPP_
+	atomic_init(&q->nWaiters, 0);
+	atomic_flag_clear(&q->waitLock);
+	#endif
 }
 // Actual queue push.
 static void qpush(intq* self, qitem* n)
@@ -62,87 +81,286 @@ queue *queue_create()
 	if(ret == NULL) 
 		return NULL;
 
+	#if !defined(__linux__)
 	if (SEM_INIT(ret->sem))
 		return NULL;
+	#endif
+	atomic_init(&ret->sleeping, 0);
+	atomic_init(&ret->length, 0);
+	ret->spin = SPIN_MIN;
 	initq(&ret->q);
 
 	return ret;
 }
 
+// Queue with a SPSC ring for every producer in front of the MPSC queue.
+// ringSize must be a power of 2.
+queue *queue_create_rings(int nRings, uint32_t ringSize)
+{
+	int i;
+	queue *ret = queue_create();
+
+	if (ret == NULL || nRings <= 0 || ringSize == 0 || (ringSize & (ringSize - 1)))
+		return ret;
+	ret->rings = calloc(nRings, sizeof(spsc_ring*));
+	for (i = 0; i < nRings; i++)
+	{
+		ret->rings[i] = calloc(1, sizeof(spsc_ring) + ringSize*sizeof(qitem*));
+		ret->rings[i]->mask = ringSize - 1;
+	}
+	ret->nRings = nRings;
+	return ret;
+}
+
 void queue_destroy(queue *queue)
 {
+	int i;
+	#if !defined(__linux__)
 	SEM_DESTROY(queue->sem);
+	#endif
+	for (i = 0; i < queue->nRings; i++)
+		free(queue->rings[i]);
+	free(queue->rings);
 	free(queue);
 }
 
+// Called once on every producer thread that should use rings.
+void queue_set_producer(int index)
+{
+	tls_ring = index;
+}
+
+static int ring_push(spsc_ring *r, qitem *entry)
+{
+	uint32_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (h - r->cachedTail > r->mask)
+	{
+		r->cachedTail = atomic_load_explicit(&r->tail, memory_order_acquire);
+		if (h - r->cachedTail > r->mask)
+			return 0;
+	}
+	r->items[h & r->mask] = entry;
+	// seq_cst so that it is ordered before the sleeping check in queue_push.
+	atomic_store(&r->head, h + 1);
+	return 1;
+}
+
+static qitem* ring_pop(spsc_ring *r)
+{
+	qitem *entry;
+	uint32_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (t == r->cachedHead)
+	{
+		r->cachedHead = atomic_load(&r->head);
+		if (t == r->cachedHead)
+			return NULL;
+	}
+	entry = r->items[t & r->mask];
+	atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+	return entry;
+}
+
+// Scan rings round robin, then the shared queue.
+static qitem* pop(queue *queue)
+{
+	int i;
+	qitem *r;
+	for (i = 0; i < queue->nRings; i++)
+	{
+		int index = queue->ringPos + i;
+		if (index >= queue->nRings)
+			index -= queue->nRings;
+		r = ring_pop(queue->rings[index]);
+		if (r)
+		{
+			queue->ringPos = index + 1 < queue->nRings ? index + 1 : 0;
+			atomic_fetch_sub_explicit(&queue->length, 1, memory_order_relaxed);
+			return r;
+		}
+	}
+	r = qpop(&queue->q);
+	if (r)
+		atomic_fetch_sub_explicit(&queue->length, 1, memory_order_relaxed);
+	return r;
+}
+
+// Called on producer. If it has a ring in queue and it is full, push must not
+// be called. Items in a ring are only ordered with each other, so once a producer
+// has a ring it can not overflow to the shared queue.
+int queue_full(queue *queue)
+{
+	spsc_ring *r;
+	uint32_t h;
+	if (tls_ring < 0 || tls_ring >= queue->nRings)
+		return 0;
+	r = queue->rings[tls_ring];
+	h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (h - r->cachedTail > r->mask)
+		r->cachedTail = atomic_load(&r->tail);
+	return (h - r->cachedTail > r->mask);
+}
+
+size_t queue_length(queue *queue)
+{
+	return atomic_load_explicit(&queue->length, memory_order_relaxed);
+}
+
 // Push item from scheduler thread to worker thread.
+// Consumer is only woken up if it is parked.
 int queue_push(queue *queue, qitem *entry)
 {
-	qpush(&queue->q, entry);
-	SEM_POST(queue->sem);
+	// Counted before it is visible, so consumer never takes length below 0.
+	atomic_fetch_add_explicit(&queue->length, 1, memory_order_relaxed);
+	if (tls_ring < 0 || tls_ring >= queue->nRings)
+		qpush(&queue->q, entry);
+	else if (!ring_push(queue->rings[tls_ring], entry))
+	{
+		atomic_fetch_sub_explicit(&queue->length, 1, memory_order_relaxed);
+		return 0;
+	}
+	if (atomic_load(&queue->sleeping) && atomic_exchange(&queue->sleeping, 0))
+		UNPARK(queue);
 	return 1;
 }
 
 // Return item if available, otherwise NULL.
 qitem* queue_trypop(queue *queue)
 {
-	return qpop(&queue->q);
+	return pop(queue);
+}
+
+// Mark consumer as sleeping and park until woken up or timeout.
+// Sleeping flag is set before checking queue one last time. Producers push before
+// checking flag, so either we see the item or they see the flag.
+static qitem* park(queue *queue, uint32_t miliseconds)
+{
+	qitem *r;
+	atomic_store(&queue->sleeping, 1);
+	r = pop(queue);
+	if (r)
+	{
+		atomic_store(&queue->sleeping, 0);
+		return r;
+	}
+	PARK(queue, miliseconds);
+	atomic_store(&queue->sleeping, 0);
+	return pop(queue);
 }
 
 // Get item or wait max time.
 qitem* queue_timepop(queue *queue, uint32_t miliseconds)
 {
-	qitem *r = qpop(&queue->q);
+	qitem *r = pop(queue);
 	if (r)
 		return r;
-	else
-	{
-		if (SEM_TIMEDWAIT(queue->sem, miliseconds) != 0)
-			return NULL;
-		else
-			return qpop(&queue->q);
-	}
+	return park(queue, miliseconds);
 }
 
 // Called on worker thread to get an item. Will wait if no items are available.
-// Does busy wait for 2ms.
+// Spins for a while before parking. If spinning finds work, we spin longer next time.
+// If it does not, shorter.
 qitem* queue_pop(queue *queue)
 {
-	qitem *r = qpop(&queue->q);
+	int i;
+	qitem *r = pop(queue);
 	if (r)
 		return r;
+
+	for (i = 0; i < queue->spin; i++)
+	{
+		CPU_RELAX();
+		r = pop(queue);
+		if (r)
+		{
+			if (queue->spin < SPIN_MAX)
+				queue->spin *= 2;
+			return r;
+		}
+	}
+	if (queue->spin > SPIN_MIN)
+		queue->spin /= 2;
+
+	while (1)
+	{
+		r = park(queue, ~0);
+		if (r)
+			return r;
+	}
+}
+
+#ifndef _TESTAPP_
+// Send a wake message to every process waiting on queue.
+static void wake_waiters(intq *q)
+{
+	int i;
+	while (atomic_flag_test_and_set(&q->waitLock))
+	{
+	}
+	for (i = 0; i < atomic_load(&q->nWaiters); i++)
+	{
+		ErlNifEnv *env = q->waitEnvs[i];
+		enif_send(NULL, &q->waitPids[i], env, 
+			enif_make_tuple2(env, enif_make_atom(env, "aqdrv_wake"), q->waitRefs[i]));
+		enif_clear_env(env);
+	}
+	atomic_store(&q->nWaiters, 0);
+	atomic_flag_clear(&q->waitLock);
+}
+
+// Called on scheduler thread after queue_get_item returned NULL or target
+// queue was full.
+// Registers pid to receive {aqdrv_wake, Ref} once an item is recycled.
+// Returns 1 if registered, 0 if an item became available and target has room
+// in the meantime and -1 if there are too many waiters already.
+int queue_wait_item(ErlNifPid *pid, ErlNifEnv *env, ERL_NIF_TERM ref, queue *target)
+{
+	intq *q = tls_reuseq;
+	int n, rc = 1;
+
+	while (atomic_flag_test_and_set(&q->waitLock))
+	{
+	}
+	n = atomic_load(&q->nWaiters);
+	if (n == MAX_WAITERS)
+		rc = -1;
 	else
 	{
-		TIME start;
-		GETTIME(start);
-		INITTIME;
-		while (1)
+		// Increment before checking queue. Recycling thread pushes before
+		// checking nWaiters, so one of us will see the other.
+		// Items in target ring are recycled after they are popped, so waiting for
+		// a recycle also covers a full ring.
+		atomic_store(&q->nWaiters, n+1);
+		if (q->tail->next != NULL && !queue_full(target))
 		{
-			u64 diff;
-			TIME stop;
-			sched_yield();
-			GETTIME(stop);
-			NANODIFF(stop, start, diff);
-
-			r = qpop(&queue->q);
-			if (r)
-				return r;
-			if (diff > 2000000) // 2ms max busy wait
-			{
-				SEM_WAIT(queue->sem);
-			}
+			atomic_store(&q->nWaiters, n);
+			rc = 0;
+		}
+		else
+		{
+			if (q->waitEnvs[n] == NULL)
+				q->waitEnvs[n] = enif_alloc_env();
+			q->waitPids[n] = *pid;
+			q->waitRefs[n] = enif_make_copy(q->waitEnvs[n], ref);
 		}
 	}
+	atomic_flag_clear(&q->waitLock);
+	return rc;
 }
+#endif
 
 // Push entry back to home queue.
 // Called from worker thread to give an entry back to a scheduler thread.
 void queue_recycle(qitem *entry)
 {
-	qpush(entry->home, entry);
+	intq *home = entry->home;
+	qpush(home, entry);
+	#ifndef _TESTAPP_
+	if (atomic_load(&home->nWaiters) > 0)
+		wake_waiters(home);
+	#endif
 }
 
-// Called only once per thread.
+// Called once per thread and whenever queue needs to grow.
 static void populate(intq *q)
 {
 	int i;
@@ -167,18 +385,25 @@ static void populate(intq *q)
 
 // scheduler thread is the single consumer of tls_reuseq
 // producers are worker threads or scheduler thread itself.
-// We have a fixed number of events that are populated on first call.
-// If return NULL, caller should busy wait, go do something else or sleep.
+// Events are populated on first call and whenever we run out,
+// until there are MAX_BLOCKS*BLOCK_SIZE of them.
+// If return NULL, caller should wait for an item to be recycled (queue_wait_item).
 qitem* queue_get_item(void)
 {
-	// qitem *res;
+	qitem *res;
 	if (tls_reuseq == NULL)
 	{
 		tls_reuseq = calloc(1,sizeof(intq));
 		initq(tls_reuseq);
 		populate(tls_reuseq);
 	}
-	return qpop(tls_reuseq);
+	res = qpop(tls_reuseq);
+	if (res == NULL && tls_qsize < MAX_BLOCKS*BLOCK_SIZE)
+	{
+		populate(tls_reuseq);
+		res = qpop(tls_reuseq);
+	}
+	return res;
 }
 
 void queue_intq_destroy(intq *q)
@@ -200,6 +425,16 @@ void queue_intq_destroy(intq *q)
 		if (q->head->blockStart)
 			free(q->head);
 	}
+	#ifndef _TESTAPP_
+	{
+		int i;
+		for (i = 0; i < MAX_WAITERS; i++)
+		{
+			if (q->waitEnvs[i])
+				enif_free_env(q->waitEnvs[i]);
+		}
+	}
+	#endif
 	free(q);
 }
 
@@ -209,39 +444,46 @@ void queue_intq_destroy(intq *q)
 //  TEST APP
 // 
 // 
-// gcc c_src/lfqueue.c -DTEST_LQUEUE -D_TESTAPP_ -DSQLITE_DEFAULT_PAGE_SIZE=4096 -lpthread -o lfq
+// gcc -O2 c_src/lfqueue.c c_src/platform.c -DTEST_LQUEUE -D_TESTAPP_ -lpthread -o lfq
+// ./lfq [ringsize] [producers]
+// ringsize 0 (default) uses only the MPSC queue. Otherwise every producer gets
+// a ring of that size. Prints throughput, p99 push to pop latency and how many
+// times producers found their ring full (the wait path in aqdrv).
 #ifdef TEST_LQUEUE
 typedef struct item
 {
 	int thread;
 	uint64_t n;
-	uint32_t recycled;
+	TIME pushed;
 }item;
 
 typedef struct threadinf
 {
 	int thread;
+	int rings;
 	queue *q;
+	uint64_t nfull;
 }threadinf;
 
-#define ITERATIONS 1000000
-#define NUM_THREADS 20
+#define ITERATIONS 200000
+#define MAX_THREADS 64
 
 static void *producer(void *arg)
 {
 	threadinf *inf = (threadinf*)arg;
-	char *op;
-	uint64_t i;
-	long long int me = (long long int)pthread_self();
 	uint64_t val = 1;
 
-	while (val < ITERATIONS)
+	if (inf->rings)
+		queue_set_producer(inf->thread);
+	while (val <= ITERATIONS)
 	{
-		// printf("PULL! %lld\n",me);
 		item *it;
-		qitem *qi = queue_get_item(inf->q);
+		qitem *qi = queue_get_item();
 		if (!qi)
+		{
+			sched_yield();
 			continue;
+		}
 		if (qi->cmd == NULL)
 			qi->cmd = calloc(1,sizeof(item));
 		if (qi->home != tls_reuseq)
@@ -250,71 +492,88 @@ static void *producer(void *arg)
 			exit(1);
 		}
 		it = (item*)qi->cmd;
-		// if (it->recycled)
-		// 	printf("RECYCLED! %u %d\n",it->recycled, inf->thread);
 		it->n = val++;
 		it->thread = inf->thread;
-		queue_push(inf->q,qi);
-		// if (tries > 10)
-			// printf("%lld, i=%d, tries=%d, index=%d\n",me, i, tries, index);
-
-		// if ((i % 10000) == 0)
-		// 	printf("pthr=%lld, i=%d\n",me, i);
+		GETTIME(it->pushed);
+		while (!queue_push(inf->q,qi))
+		{
+			inf->nfull++;
+			sched_yield();
+			GETTIME(it->pushed);
+		}
 	}
-	printf("Thread done %llu\n", tls_qsize);
-
 	return NULL;
 }
 
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
 
 int main(int argc, const char* argv[])
 {
 	queue* q;
-	int i;
-	pthread_t threads[NUM_THREADS];
-	threadinf infos[NUM_THREADS];
-	uint64_t thrnums[NUM_THREADS];
-
-	q = queue_create();
-	for (i = 0; i < NUM_THREADS; i++)
+	int i, nthreads = 4;
+	uint32_t ringSize = 0;
+	pthread_t threads[MAX_THREADS];
+	threadinf infos[MAX_THREADS];
+	uint64_t thrnums[MAX_THREADS];
+	uint64_t *lat, nlat = 0, diff, nfull = 0;
+	TIME start, stop, now;
+
+	if (argc > 1)
+		ringSize = (uint32_t)atoi(argv[1]);
+	if (argc > 2)
+		nthreads = atoi(argv[2]);
+	if (nthreads <= 0 || nthreads > MAX_THREADS)
+		return 1;
+
+	q = ringSize ? queue_create_rings(nthreads, ringSize) : queue_create();
+	lat = malloc(sizeof(uint64_t)*ITERATIONS*nthreads);
+	GETTIME(start);
+	for (i = 0; i < nthreads; i++)
 	{
 		thrnums[i] = 1;
 		infos[i].thread = i;
+		infos[i].rings = ringSize > 0;
 		infos[i].q = q;
+		infos[i].nfull = 0;
 		pthread_create(&threads[i], NULL, producer, (void *)&infos[i]);
 	}
 
-	// for (i = 0; i < ITERATIONS*NUM_THREADS; i++)
 	i = 0;
-	TIME start;
-	GETTIME(start);
-	while (i < NUM_THREADS)
+	while (i < nthreads)
 	{
 		qitem *qi = queue_pop(q);
 		item *it = (item*)qi->cmd;
+		GETTIME(now);
+		NANODIFF(now, it->pushed, diff);
+		lat[nlat++] = diff;
 		if (thrnums[it->thread] != it->n)
 		{
-			printf("Items not sequential thread=%d, n=%llu, shouldbe=%llu, recycled=%u!!\n", 
-				it->thread, it->n, thrnums[it->thread], it->recycled);
-			return 0;
+			printf("Items not sequential thread=%d, n=%llu, shouldbe=%llu\n",
+				it->thread, (unsigned long long)it->n, (unsigned long long)thrnums[it->thread]);
+			return 1;
 		}
 		thrnums[it->thread]++;
-		if (thrnums[it->thread] == ITERATIONS)
+		if (thrnums[it->thread] > ITERATIONS)
 			i++;
-		// printf("Recycle thr=%d val=%llu, recycled=%u\n",it->thread,it->n, it->recycled++);
-		queue_recycle(q,qi);
+		queue_recycle(qi);
 	}
-	uint64_t diff;
-	TIME stop;
 	GETTIME(stop);
 	NANODIFF(stop, start, diff);
-	printf("Done in: %llums\n",diff / 1000000);
-
-	// for (i = 0; i < NUM_THREADS; i++)
-	// 	printf("threadpos =%llu\n",thrnums[i]);
-		// pthread_join(threads[i],NULL);
-
-	// printf("No thread sync errors!\n");
+	for (i = 0; i < nthreads; i++)
+	{
+		pthread_join(threads[i],NULL);
+		nfull += infos[i].nfull;
+	}
+	qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+	printf("ring=%u producers=%d items=%llu time=%llums ops/s=%llu p50=%lluns p99=%lluns full=%llu\n",
+		ringSize, nthreads, (unsigned long long)nlat, (unsigned long long)(diff / 1000000),
+		(unsigned long long)(nlat * 1000000000ull / (diff ? diff : 1)),
+		(unsigned long long)lat[nlat / 2], (unsigned long long)lat[nlat * 99 / 100],
+		(unsigned long long)nfull);
 	return 0;
 }
 
@@ -25,29 +25,76 @@ struct qitem_t
 	intq *home;
 };
 
+#define MAX_WAITERS 64
+#define CACHE_LINE 64
+
+// Bounded single producer single consumer ring.
+// Indexes are on their own cache lines, each side keeps a cached copy of the
+// other side's index so it only touches the shared line when it has to.
+typedef struct spsc_ring
+{
+	_Atomic (uint32_t) head;
+	uint32_t cachedTail;
+	char pad1[CACHE_LINE];
+	_Atomic (uint32_t) tail;
+	uint32_t cachedHead;
+	char pad2[CACHE_LINE];
+	uint32_t mask;
+	qitem *items[];
+} spsc_ring;
+
 struct intq
 {
 	_Atomic (qitem*) head;
 	qitem* tail;
+	#ifndef _TESTAPP_
+	// Processes waiting for an item to be recycled to this queue.
+	// Only used on reuse queues.
+	_Atomic (int) nWaiters;
+	atomic_flag waitLock;
+	ErlNifPid waitPids[MAX_WAITERS];
+	ERL_NIF_TERM waitRefs[MAX_WAITERS];
+	ErlNifEnv *waitEnvs[MAX_WAITERS];
+	#endif
 };
 
 struct queue_t
 {
 	struct intq q;
+	#if !defined(__linux__)
 	SEMAPHORE sem;
-	size_t length;
+	#endif
+	// Set by consumer before parking. Producers only wake it up if set.
+	// On linux it is also the futex word.
+	_Atomic (int) sleeping;
+	// How many times consumer spins before parking. Adapts to load.
+	int spin;
+	// Items pushed and not yet popped. Approximate, for placement decisions.
+	_Atomic (size_t) length;
+	// Optional ring for every producer (scheduler). Producers without a ring
+	// or with a full ring use q.
+	spsc_ring **rings;
+	int nRings;
+	int ringPos;
 };
 
 queue *queue_create(void);
+queue *queue_create_rings(int nRings, uint32_t ringSize);
 void queue_destroy(queue *queue);
+void queue_set_producer(int index);
 
 int queue_push(queue *queue, qitem* item);
+int queue_full(queue *queue);
+size_t queue_length(queue *queue);
 qitem* queue_pop(queue *queue);
 qitem* queue_trypop(queue *queue);
 qitem* queue_timepop(queue *queue, uint32_t miliseconds);
 
 void queue_recycle(qitem* item);
 qitem* queue_get_item(void);
+#ifndef _TESTAPP_
+int queue_wait_item(ErlNifPid *pid, ErlNifEnv *env, ERL_NIF_TERM ref, queue *target);
+#endif
 void queue_intq_destroy(intq *q);
 
 #endif 
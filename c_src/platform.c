@@ -1,4 +1,10 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "platform.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 void writeUint32(u8 *p, u32 v)
 {
@@ -8,6 +14,11 @@ void writeUint32(u8 *p, u32 v)
 	p[3] = (u8)v;
 }
 
+u32 readUint32(const u8 *p)
+{
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
 void writeUint32LE(u8 *p, u32 v)
 {
 	p[0] = (u8)v;
@@ -16,6 +27,40 @@ void writeUint32LE(u8 *p, u32 v)
 	p[3] = (u8)(v >> 24);
 }
 
+// Data copied into segment mapping is not read again by writer,
+// do not evict useful cache lines with it.
+void copy_nt(u8 *dst, const u8 *src, size_t len)
+{
+#if defined(__SSE2__)
+	if (len >= NT_THRESHOLD)
+	{
+		// Align destination to 16 bytes for streaming stores.
+		const size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+		memcpy(dst, src, head);
+		dst += head;
+		src += head;
+		len -= head;
+		while (len >= 64)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)src);
+			__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+			__m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+			__m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+			_mm_stream_si128((__m128i*)dst, a);
+			_mm_stream_si128((__m128i*)(dst + 16), b);
+			_mm_stream_si128((__m128i*)(dst + 32), c);
+			_mm_stream_si128((__m128i*)(dst + 48), d);
+			dst += 64;
+			src += 64;
+			len -= 64;
+		}
+		// Streaming stores are weakly ordered.
+		_mm_sfence();
+	}
+#endif
+	memcpy(dst, src, len);
+}
+
 #ifdef _WIN32
 int clock_gettime(int X, struct timespec* tp)
 {
@@ -51,3 +96,123 @@ int SEM_TIMEDWAIT(sem_t s, uint32_t milis)
 	return r;
 }
 #endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+int futex_wait(_Atomic(int) *addr, int val, u32 milis)
+{
+	struct timespec ts;
+	struct timespec *pts = NULL;
+
+	if (milis != (u32)~0)
+	{
+		ts.tv_sec = milis / 1000;
+		ts.tv_nsec = (milis % 1000) * 1000000;
+		pts = &ts;
+	}
+	return syscall(SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, val, pts, NULL, 0);
+}
+
+void futex_wake(_Atomic(int) *addr)
+{
+	syscall(SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+// Restrict calling thread to cpus.
+int pin_thread(const int *cpus, int n)
+{
+	cpu_set_t set;
+	int i;
+
+	if (n <= 0)
+		return 0;
+	CPU_ZERO(&set);
+	for (i = 0; i < n; i++)
+	{
+		if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+			CPU_SET(cpus[i], &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// NUMA node of the block device that holds path, -1 if unknown.
+int path_numa_node(const char *path)
+{
+	char name[128];
+	struct stat st;
+	int node = -1;
+	FILE *f;
+
+	if (stat(path, &st) != 0)
+		return -1;
+	snprintf(name, sizeof(name), "/sys/dev/block/%u:%u/device/numa_node", 
+		major(st.st_dev), minor(st.st_dev));
+	f = fopen(name, "r");
+	if (f == NULL)
+	{
+		// Partitions have no device link, the disk they are on does.
+		snprintf(name, sizeof(name), "/sys/dev/block/%u:%u/../device/numa_node", 
+			major(st.st_dev), minor(st.st_dev));
+		f = fopen(name, "r");
+	}
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+// Fill cpus of NUMA node, returns how many. cpulist is like 0-7,16-23
+int node_cpus(int node, int *cpus, int max)
+{
+	char name[128];
+	int n = 0, from, to;
+	FILE *f;
+
+	snprintf(name, sizeof(name), "/sys/devices/system/node/node%d/cpulist", node);
+	f = fopen(name, "r");
+	if (f == NULL)
+		return 0;
+	while (fscanf(f, "%d", &from) == 1)
+	{
+		int c = fgetc(f);
+		to = from;
+		if (c == '-')
+		{
+			if (fscanf(f, "%d", &to) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (; from <= to && n < max; from++)
+			cpus[n++] = from;
+		if (c != ',')
+			break;
+	}
+	fclose(f);
+	return n;
+}
+#else
+int pin_thread(const int *cpus, int n)
+{
+	return -1;
+}
+
+int path_numa_node(const char *path)
+{
+	return -1;
+}
+
+int node_cpus(int node, int *cpus, int max)
+{
+	return 0;
+}
+#endif
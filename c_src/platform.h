@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #ifndef _WIN32
 #include <pthread.h>
@@ -32,6 +33,16 @@
 	#define IOV_SEND(RT, FD, IOV, IOVSIZE) RT = writev(FD,IOV,IOVSIZE)
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+	#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+	#define CPU_RELAX() __asm__ __volatile__("yield")
+#elif defined(_WIN32)
+	#define CPU_RELAX() YieldProcessor()
+#else
+	#define CPU_RELAX()
+#endif
+
 #if defined(__APPLE__)
 	#include <mach/mach_time.h>
 	#include <libkern/OSAtomic.h>
@@ -91,7 +102,23 @@
 	 ((START.tv_sec * 1000000000UL) + START.tv_nsec)
 #endif
 
+#if defined(__linux__)
+	// Park on an int. Timeout of ~0 waits forever.
+	#define FUTEX_WAIT(X,V,T) futex_wait(&X, V, T)
+	#define FUTEX_WAKE(X) futex_wake(&X)
+	int futex_wait(_Atomic(int) *addr, int val, u32 miliseconds);
+	void futex_wake(_Atomic(int) *addr);
+#endif
+
 void writeUint32LE(u8 *p, u32 v);
 void writeUint32(u8 *p, u32 v);
+u32 readUint32(const u8 *p);
+// memcpy that bypasses cache for copies of at least NT_THRESHOLD bytes.
+#define NT_THRESHOLD 16*1024
+void copy_nt(u8 *dst, const u8 *src, size_t len);
+// Thread placement. Only implemented on linux.
+int pin_thread(const int *cpus, int n);
+int path_numa_node(const char *path);
+int node_cpus(int node, int *cpus, int max);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,300 @@
+#include "record.h"
+#include "xxhash.h"
+#include "lz4.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Parsing records from a segment. Data is only decompressed by lz4_frame_range.
+
+u32 readUint32LE(const u8 *p)
+{
+	return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static u64 readUint64LE(const u8 *p)
+{
+	return (u64)readUint32LE(p) | ((u64)readUint32LE(p + 4) << 32);
+}
+
+void write_trailer(u8 *trailer, int hasHash, u64 hash)
+{
+	int i;
+	writeUint32LE(trailer, TRAILER_MAGIC);
+	writeUint32LE(trailer + 4, hasHash ? 8 : 0);
+	if (!hasHash)
+		return;
+	for (i = 0; i < 8; i++)
+		trailer[8 + i] = (u8)(hash >> (i * 8));
+}
+
+// Size of lz4 frame by walking block headers. 0 if malformed.
+static u64 lz4_frame_size(const u8 *p, u64 avail)
+{
+	u8 flg;
+	u64 pos = 7;
+
+	if (avail < 7)
+		return 0;
+	flg = p[4];
+	if (flg & 0x08)
+		pos += 8;
+	if (flg & 0x01)
+		pos += 4;
+	while (1)
+	{
+		u32 bsize;
+		if (pos + 4 > avail)
+			return 0;
+		bsize = readUint32LE(p + pos);
+		pos += 4;
+		if (bsize == 0)
+			break;
+		pos += (bsize & 0x7FFFFFFF);
+		if (flg & 0x10)
+			pos += 4;
+	}
+	if (flg & 0x04)
+		pos += 4;
+	if (pos > avail)
+		return 0;
+	return pos;
+}
+
+// Size of record at p including trailer, not including packed length.
+// 0 if there is no complete record at p.
+u32 record_size(const u8 *p, u64 avail)
+{
+	u64 pos = 0;
+	int frames = 0;
+
+	if (avail < 8 || readUint32LE(p) != FRAME_MAGIC)
+		return 0;
+	// Header, then map and data. Map is not there if nothing was staged.
+	while (frames < 3)
+	{
+		u32 magic;
+		if (pos + 8 > avail)
+			return 0;
+		magic = readUint32LE(p + pos);
+		if (magic == FRAME_MAGIC)
+			pos += 8 + (u64)readUint32LE(p + pos + 4);
+		else if (magic == LZ4_MAGIC)
+		{
+			u64 sz = lz4_frame_size(p + pos, avail - pos);
+			if (!sz)
+				return 0;
+			pos += sz;
+		}
+		else if (magic == TRAILER_MAGIC && frames > 0)
+			break;
+		else
+			return 0;
+		frames++;
+	}
+	if (pos + EMPTY_TRAILER_SIZE > avail || readUint32LE(p + pos) != TRAILER_MAGIC)
+		return 0;
+	switch (readUint32LE(p + pos + 4))
+	{
+		case 0:
+			pos += EMPTY_TRAILER_SIZE;
+			break;
+		case 8:
+			pos += TRAILER_SIZE;
+			break;
+		default:
+			return 0;
+	}
+	if (pos > avail)
+		return 0;
+	if (pos > 0xFFFFFFFF)
+		return 0;
+	return (u32)pos;
+}
+
+// Locate header, map and data frames of a record. Size must come from record_size.
+// Returns 0 if record is malformed.
+int record_frames(const u8 *p, u32 size, recframes *out)
+{
+	u32 pos;
+
+	memset(out, 0, sizeof(recframes));
+	out->hdrPos = 8;
+	out->hdrSize = readUint32LE(p + 4);
+	pos = 8 + out->hdrSize;
+	if (pos + 8 > size || readUint32LE(p + pos) == TRAILER_MAGIC)
+		return pos + 8 <= size;
+	if (readUint32LE(p + pos) != FRAME_MAGIC)
+		return 0;
+	out->mapPos = pos + 8;
+	out->mapSize = readUint32LE(p + pos + 4);
+	pos = out->mapPos + out->mapSize;
+	if (pos + 8 > size)
+		return 0;
+	if (readUint32LE(p + pos) == LZ4_MAGIC)
+	{
+		out->compressed = 1;
+		out->dataPos = pos;
+		out->dataSize = (u32)lz4_frame_size(p + pos, size - pos);
+		return out->dataSize > 0;
+	}
+	else if (readUint32LE(p + pos) == FRAME_MAGIC)
+	{
+		out->dataPos = pos + 8;
+		out->dataSize = readUint32LE(p + pos + 4);
+		return out->dataPos + out->dataSize <= size;
+	}
+	return 0;
+}
+
+// Decompress size bytes at uncompressed offset of lz4 frame into out.
+// Frame must have independent blocks. Blocks before offset are skipped without
+// decompressing, which relies on every block but last being full block size as
+// written by LZ4F without flushes. Returns 0 if frame is malformed or too short.
+int lz4_frame_range(const u8 *frame, u32 frameSize, u32 offset, u32 size, u8 *out)
+{
+	const u8 flg = frame[4];
+	const u32 blockSize = 1 << (8 + 2 * ((frame[5] >> 4) & 7));
+	u64 blockStart = 0;
+	u32 pos = 7, done = 0;
+	u8 *tmp = NULL;
+
+	if (!(flg & 0x20))
+		return 0;
+	if (flg & 0x08)
+		pos += 8;
+	if (flg & 0x01)
+		pos += 4;
+	while (done < size && pos + 4 <= frameSize)
+	{
+		const u32 bsize = readUint32LE(frame + pos);
+		const u32 len = bsize & 0x7FFFFFFF;
+		const u8 *data = frame + pos + 4;
+		u32 from, want;
+
+		if (bsize == 0 || pos + 4 + len > frameSize)
+			break;
+		pos += 4 + len + ((flg & 0x10) ? 4 : 0);
+		if (blockStart + blockSize <= (u64)offset + done)
+		{
+			blockStart += blockSize;
+			continue;
+		}
+		from = offset + done - blockStart;
+		want = size - done < blockSize - from ? size - done : blockSize - from;
+		if (bsize & 0x80000000)
+		{
+			// Stored uncompressed
+			if (from + want > len)
+				break;
+			memcpy(out + done, data + from, want);
+		}
+		else if (from == 0 && want == blockSize)
+		{
+			if (LZ4_decompress_safe((const char*)data, (char*)out + done, len, want) != (int)want)
+				break;
+		}
+		else
+		{
+			// Partial decode may write past target, up to its capacity.
+			if (!tmp)
+				tmp = malloc(blockSize);
+			if (LZ4_decompress_safe_partial((const char*)data, (char*)tmp, len, 
+				from + want, blockSize) < (int)(from + want))
+				break;
+			memcpy(out + done, tmp + from, want);
+		}
+		done += want;
+		blockStart += blockSize;
+	}
+	free(tmp);
+	return done == size;
+}
+
+// Does trailer hash match record contents. Size must come from record_size.
+// Records with empty trailer have nothing to check.
+int record_check(const u8 *p, u32 size)
+{
+	if (size >= TRAILER_SIZE && 
+		readUint32LE(p + size - TRAILER_SIZE) == TRAILER_MAGIC &&
+		readUint32LE(p + size - TRAILER_SIZE + 4) == 8)
+	{
+		const u32 end = size - TRAILER_SIZE;
+		u32 prefix = end;
+		u64 seed = 0;
+		recframes fr;
+
+		// Data frame past its first 8 bytes is hashed separately.
+		if (record_frames(p, size, &fr) && fr.dataPos)
+		{
+			prefix = (fr.compressed ? fr.dataPos : fr.dataPos - 8) + 8;
+			if (prefix > end)
+				return 0;
+			seed = XXH64(p + prefix, end - prefix, 0);
+		}
+		return XXH64(p, prefix, seed) == readUint64LE(p + size - 8);
+	}
+	return size >= EMPTY_TRAILER_SIZE &&
+		readUint32LE(p + size - EMPTY_TRAILER_SIZE) == TRAILER_MAGIC &&
+		readUint32LE(p + size - 4) == 0;
+}
+
+// Record at pos, which is at a multiple of align. Records are packed below
+// WRITE_ALIGNMENT (512) and prefixed with length.
+// Returns position of next record, 0 if there is no record at pos.
+u64 next_record(const u8 *map, u64 pos, u64 limit, u32 align, recpos *rec)
+{
+	u64 start = pos;
+	u64 size;
+
+	if (pos + 8 >= limit)
+		return 0;
+	if (align < 512)
+	{
+		u32 len = readUint32LE(map + pos);
+		start += 4;
+		if (len == 0 || start + len > limit)
+			return 0;
+		size = record_size(map + start, len);
+		if (size != len)
+			return 0;
+	}
+	else
+	{
+		size = record_size(map + start, limit - start);
+		if (!size)
+			return 0;
+	}
+	rec->pos = start;
+	rec->size = size;
+	// Writer reserved whole record rounded up to alignment.
+	size = start + size - pos;
+	if (size % align)
+		size += align - (size % align);
+	return pos + size;
+}
+
+// Find all records in segment.
+// Returns position after last record that was found.
+u64 segment_records(const u8 *map, u64 limit, u32 align, recpos **out, u32 *nOut)
+{
+	u32 n = 0, cap = 1024;
+	recpos *recs = malloc(cap * sizeof(recpos));
+	u64 pos = 0, end = 0;
+
+	while (1)
+	{
+		if (n == cap)
+		{
+			cap *= 2;
+			recs = realloc(recs, cap * sizeof(recpos));
+		}
+		pos = next_record(map, pos, limit, align, &recs[n]);
+		if (!pos)
+			break;
+		end = recs[n].pos + recs[n].size;
+		n++;
+	}
+	*out = recs;
+	*nOut = n;
+	return end;
+}
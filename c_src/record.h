@@ -0,0 +1,48 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "platform.h"
+
+// Record on disk:
+// [4 byte LE length, only in packed mode]
+// [header skippable frame][map skippable frame][data: lz4 frame or skippable frame]
+// [trailer skippable frame: magic, 8, hash]
+// Hash is XXH64 of everything before data frame and first 8 bytes of data frame,
+// seeded with XXH64 of rest of data frame. Writer hashes data while it is staged.
+// Trailer may also be empty (magic, 0), record then has no checksum.
+#define FRAME_MAGIC 0x184D2A50
+#define TRAILER_MAGIC 0x184D2A51
+#define LZ4_MAGIC 0x184D2204
+#define TRAILER_SIZE 16
+#define EMPTY_TRAILER_SIZE 8
+
+typedef struct recpos
+{
+	u64 pos;
+	u32 size;
+} recpos;
+
+// Frames of a record, positions are from start of record (after packed length).
+// Sizes do not include 8 byte frame headers, except for lz4 data frame which
+// is whole frame. mapSize is 0 if no events were staged.
+typedef struct recframes
+{
+	u32 hdrPos;
+	u32 hdrSize;
+	u32 mapPos;
+	u32 mapSize;
+	u32 dataPos;
+	u32 dataSize;
+	u8 compressed;
+} recframes;
+
+u32 readUint32LE(const u8 *p);
+void write_trailer(u8 *trailer, int hasHash, u64 hash);
+u32 record_size(const u8 *p, u64 avail);
+int record_check(const u8 *p, u32 size);
+int record_frames(const u8 *p, u32 size, recframes *out);
+int lz4_frame_range(const u8 *frame, u32 frameSize, u32 offset, u32 size, u8 *out);
+u64 next_record(const u8 *map, u64 pos, u64 limit, u32 align, recpos *rec);
+u64 segment_records(const u8 *map, u64 limit, u32 align, recpos **out, u32 *nOut);
+
+#endif
@@ -1,8 +1,13 @@
 -module(aqdrv).
 -define(DELAY,5).
--export([init/1, open/2, stage_map/4, stage_data/2, 
-	stage_flush/1, write/3, inject/2, set_tunnel_connector/0, set_thread_fd/4,
-	replicate_opts/2, replicate_opts/3, index_events/5, fsync/1]).
+-define(WAKE_TIMEOUT,1000).
+-export([init/1, open/2, open/3, stage_map/4, stage_data/2, 
+	stage_flush/1, write/3, write_batch/5, inject/2, set_tunnel_connector/0, set_thread_fd/4,
+	replicate_opts/2, replicate_opts/3, index_events/5, index_events_batch/1, fsync/1,
+	set_retention/2, verify_segment/3,
+	subscribe/4, subscribe/5, unsubscribe/2, read_range/4,
+	decode/1, decode/2, find_evnum/4, segment_evnums/2,
+	seek_time/2]).
 
 init(Info) when is_map(Info) ->
 	aqdrv_nif:init(Info).
@@ -10,10 +15,24 @@ init(Info) when is_map(Info) ->
 % integer hash of name for connection
 % should data be compressed or not. Compression requires copying data,
 % if data is already compact compression is a giant waste of resources.
-open(Hash,true) ->
-	aqdrv_nif:open(Hash,1);
-open(Hash,false) ->
-	aqdrv_nif:open(Hash,0).
+open(Hash,Compr) ->
+	open(Hash,Compr,record).
+% Integrity of records written on connection:
+% record - XXH64 checksum of record as written (default)
+% lz4 - only LZ4 content checksum of compressed data
+% none - data was already verified upstream (replicated)
+open(Hash,Compr,Integrity) ->
+	I = case Integrity of
+		record -> 0;
+		lz4 -> 1;
+		none -> 2
+	end,
+	case Compr of
+		true ->
+			aqdrv_nif:open(Hash,1,I);
+		false ->
+			aqdrv_nif:open(Hash,0,I)
+	end.
 
 % Set replicator process.
 set_tunnel_connector() ->
@@ -30,16 +49,81 @@ set_thread_fd(Thread,Fd,Pos,Type) ->
 	end.
 
 % Make sure all data for last write on connection has been synced.
-fsync({aqdrv,Con}) ->
-	Ref = make_ref(),
+% With striping that is the last write on every path written since previous fsync.
+fsync(C) ->
+	fsync1(C, make_ref()).
+fsync1({aqdrv,Con} = C, Ref) ->
 	case aqdrv_nif:fsync(Ref, self(), Con) of
-		again ->
-			timer:sleep(?DELAY),
-			fsync({aqdrv,Con});
+		Wait when Wait == again; Wait == wait ->
+			backoff(Wait, Ref),
+			fsync1(C, Ref);
 		ok ->
 			receive_answer(Ref)
 	end.
 
+% When should sealed segments of a path be retired. Retired .q files are reused
+% for new segments, their index is deleted. Any of:
+% maxbytes - total size of sealed segments
+% maxage - seconds since segment was sealed
+% minindex - all consumers are past this log index (-1 to disable)
+% Same map can be given as retention in init.
+set_retention(PathIndex, #{} = Policy) ->
+	aqdrv_nif:set_retention(PathIndex, Policy).
+
+% Check record checksums of segment LogIndex on path. Runs on a dirty IO scheduler
+% and uses up to Threads threads.
+% Returns {ok, NumRecords, EndPos} or {error, {corrupt, Pos}} for first bad record.
+verify_segment(PathIndex, LogIndex, Threads) ->
+	aqdrv_nif:verify_segment(PathIndex, LogIndex, Threads).
+
+% Pid gets {aqdrv_hwm, PathIndex, LogIndex, Pos} once records past Offset of
+% segment LogIndex are synced (safe) or written (unsafe). Everything before Pos
+% can be read. Messages are coalesced, at most one every notify ms (init option).
+% Subscription moves to later segments and ends if Pid is dead.
+subscribe(PathIndex, LogIndex, Offset, Pid) ->
+	subscribe(PathIndex, LogIndex, Offset, Pid, safe).
+subscribe(PathIndex, LogIndex, Offset, Pid, safe) ->
+	aqdrv_nif:subscribe(PathIndex, LogIndex, Offset, Pid, 0);
+subscribe(PathIndex, LogIndex, Offset, Pid, unsafe) ->
+	aqdrv_nif:subscribe(PathIndex, LogIndex, Offset, Pid, 1).
+
+unsubscribe(PathIndex, Pid) ->
+	aqdrv_nif:unsubscribe(PathIndex, Pid).
+
+% Records of segment LogIndex starting at Offset, up to MaxBytes (at least one).
+% Binaries are not copied, they point to segment map which is not retired while
+% any of them is referenced. NextOffset skips alignment padding.
+% Returns {ok, [Record], NextOffset} or {eof, NextLogIndex} when segment is
+% sealed and there is nothing more to read in it.
+read_range(PathIndex, LogIndex, Offset, MaxBytes) ->
+	aqdrv_nif:read_range(PathIndex, LogIndex, Offset, MaxBytes).
+
+% Events of a record returned by read_range: {ok, Header, [{Name, Type, Data}]}.
+% With a list of names only those events are returned and only the lz4 blocks
+% they are in are decompressed.
+decode(Record) ->
+	aqdrv_nif:decode(Record, all).
+decode(Record, Names) when is_list(Names) ->
+	aqdrv_nif:decode(Record, Names).
+
+% Replication events of QName in segment LogIndex with evnum larger than Evnum,
+% found with a seek in segment index: {ok, [{Evterm, Evnum, Pos}]}.
+% Index is created once segment is synced and sealed, before that
+% {error, "not indexed"} is returned. Segments below startindex are looked up
+% in their index file, including ones indexed from .ijournal on init.
+find_evnum(PathIndex, LogIndex, QName, Evnum) ->
+	aqdrv_nif:find_evnum(PathIndex, LogIndex, QName, Evnum).
+
+% Lowest and highest evnum in segment index: {ok, Min, Max} or {ok, undefined}.
+segment_evnums(PathIndex, LogIndex) ->
+	aqdrv_nif:segment_evnums(PathIndex, LogIndex).
+
+% Where to start reading path to get everything written since Time, which is
+% erlang:system_time(millisecond). Returns {ok, LogIndex, Offset}.
+% Accurate to timeindex ms (default 1000) or timeindexmb MB (default 16) init options.
+seek_time(PathIndex, Time) ->
+	aqdrv_nif:seek_time(PathIndex, Time).
+
 % Replication data.
 replicate_opts(Con,PacketPrefix) ->
 	replicate_opts(Con,PacketPrefix,1).
@@ -50,6 +134,13 @@ replicate_opts({aqdrv, Connection},PacketPrefix,Type) ->
 index_events({aqdrv,Con},[_|_] = Names, QName, Term, Evnum) ->
 	ok = aqdrv_nif:index_events(Con, Names, QName, Term, Evnum).
 
+% index_events for many connections in one call: [{Con, Names, QName, Term, Evnum}].
+% Nothing is indexed if any of them is invalid.
+index_events_batch(L) ->
+	ok = aqdrv_nif:index_events_batch([index_entry(E) || E <- L]).
+index_entry({{aqdrv,Con}, [_|_] = Names, QName, Term, Evnum}) ->
+	{Con, Names, QName, Term, Evnum}.
+
 % Must be called before stage_data.
 % Sets name of event (binary), type (unsigned char) and size of data.
 stage_map({aqdrv,Con}, Name, Type, Size) ->
@@ -58,7 +149,8 @@ stage_map({aqdrv,Con}, Name, Type, Size) ->
 % Write event data. 
 stage_data({aqdrv,Con}, <<_/binary>> = Bin) when byte_size(Bin) < 1024*1024*1024 ->
 	stage_write1(Con,0, Bin).
-% Stage will write at most 256KB at once. This way we do not block scheduler for too long.
+% Stage will compress at most 64KB at once. This way we do not block scheduler for too long.
+% Events larger than 256KB are compressed in a single call on a dirty scheduler.
 % Data is not written to disk with this call.
 % stage_write compresses it to a buffer attached to the connection. 
 % If compression not set it just remembers the binary and does no copying (unless small).
@@ -73,29 +165,78 @@ stage_flush({aqdrv,Con}) ->
 	aqdrv_nif:stage_flush(Con).
 
 % Write to disk. 
-write({aqdrv,Con}, [_|_] = ReplData, [_|_] = Header) ->
-	Ref = make_ref(),
+% Returns {WritePos, Size, Time}. If init was called with striping => 1, 
+% connection may move between paths and result is {WritePos, Size, Time, PathIndex, Seq}.
+write(C, [_|_] = ReplData, [_|_] = Header) ->
+	write1(C, ReplData, Header, make_ref()).
+write1({aqdrv,Con} = C, ReplData, Header, Ref) ->
 	case aqdrv_nif:write(Ref, self(),Con, ReplData, Header) of
-		again ->
-			% erlang:yield(),
-			timer:sleep(?DELAY),
-			write({aqdrv,Con},ReplData, Header);
+		Wait when Wait == again; Wait == wait ->
+			backoff(Wait, Ref),
+			write1(C, ReplData, Header, Ref);
 		ok ->
 			receive_answer(Ref)
 	end.
-inject({aqdrv,Con}, Bin) ->
-	Ref = make_ref(),
+% Stage and write a list of events with a single call.
+% Events is a list of {Name, Type, Data}.
+% IndexInfo is either undefined, in which case index_events must be called
+% after replication is done, or {QName, Term, Evnum} and event names are indexed 
+% as soon as write returns.
+write_batch(C, [_|_] = Events, [_|_] = ReplData, [_|_] = Header, IndexInfo) ->
+	write_batch1(C, Events, ReplData, Header, IndexInfo, make_ref()).
+write_batch1({aqdrv,Con} = C, Events, ReplData, Header, IndexInfo, Ref) ->
+	case aqdrv_nif:write_batch(Ref, self(), Con, Events, ReplData, Header) of
+		Wait when Wait == again; Wait == wait ->
+			backoff(Wait, Ref),
+			write_batch1(C, Events, ReplData, Header, IndexInfo, Ref);
+		ok ->
+			case receive_answer(Ref) of
+				Resp when is_tuple(Resp), is_tuple(IndexInfo) ->
+					{QName, Term, Evnum} = IndexInfo,
+					ok = index_events(C, [Name || {Name,_,_} <- Events], QName, Term, Evnum),
+					Resp;
+				Resp ->
+					Resp
+			end;
+		Err ->
+			Err
+	end.
+
+inject(C, Bin) ->
+	inject1(C, Bin, make_ref()).
+inject1({aqdrv,Con} = C, Bin, Ref) ->
 	case aqdrv_nif:inject(Ref, self(), Con, Bin) of
-		again ->
-			timer:sleep(?DELAY),
-			inject({aqdrv, Con},Bin);
+		Wait when Wait == again; Wait == wait ->
+			backoff(Wait, Ref),
+			inject1(C, Bin, Ref);
 		ok ->
 			receive_answer(Ref)
 	end.
 
 
+% Driver is out of command items on our scheduler.
+% wait means we are registered and will get a message once an item is free.
+% If wake is lost (driver unloaded) we just retry.
+% again means too many are already waiting.
+% Retries of a call use the same Ref. A wake that comes after a timeout is
+% taken by next backoff of that call or flushed once the answer is received.
+backoff(wait, Ref) ->
+	receive
+		{aqdrv_wake, Ref} -> ok
+	after ?WAKE_TIMEOUT ->
+		ok
+	end;
+backoff(again, _) ->
+	timer:sleep(?DELAY).
+
 receive_answer(Ref) ->
 	receive
-		{Ref, Resp} -> Resp
+		{Ref, Resp} ->
+			receive
+				{aqdrv_wake, Ref} -> ok
+			after 0 ->
+				ok
+			end,
+			Resp
 	end.
 
@@ -1,12 +1,16 @@
 -module(aqdrv_nif).
--export([init/1, open/2, stage_map/4,stage_data/3,
-	stage_flush/1, write/5,inject/4, set_tunnel_connector/0, set_thread_fd/4,
-	replicate_opts/3,index_events/5, fsync/3, stop/0, init_tls/1]).
+-export([init/1, open/2, open/3, stage_map/4,stage_data/3,
+	stage_flush/1, write/5,write_batch/6,inject/4, set_tunnel_connector/0, set_thread_fd/4,
+	replicate_opts/3,index_events/5, index_events_batch/1, fsync/3, set_retention/2, verify_segment/3,
+	subscribe/5, unsubscribe/2, read_range/4, decode/2, find_evnum/4, segment_evnums/2,
+	seek_time/2, stop/0, init_tls/1]).
 
 stop() ->
 	exit(nif_library_not_loaded).
 open(_,_) ->
 	exit(nif_library_not_loaded).
+open(_,_,_) ->
+	exit(nif_library_not_loaded).
 stage_map(_,_,_,_) ->
 	exit(nif_library_not_loaded).
 stage_data(_,_,_) ->
@@ -15,10 +19,14 @@ stage_flush(_) ->
 	exit(nif_library_not_loaded).
 write(_,_,_,_,_) ->
 	exit(nif_library_not_loaded).
+write_batch(_,_,_,_,_,_) ->
+	exit(nif_library_not_loaded).
 inject(_,_,_,_) ->
 	exit(nif_library_not_loaded).
 index_events(_,_,_,_,_) ->
 	exit(nif_library_not_loaded).
+index_events_batch(_) ->
+	exit(nif_library_not_loaded).
 set_tunnel_connector() ->
 	exit(nif_library_not_loaded).
 set_thread_fd(_,_,_,_) ->
@@ -29,6 +37,24 @@ init_tls(_) ->
 	exit(nif_library_not_loaded).
 fsync(_,_,_) ->
 	exit(nif_library_not_loaded).
+set_retention(_,_) ->
+	exit(nif_library_not_loaded).
+verify_segment(_,_,_) ->
+	exit(nif_library_not_loaded).
+subscribe(_,_,_,_,_) ->
+	exit(nif_library_not_loaded).
+unsubscribe(_,_) ->
+	exit(nif_library_not_loaded).
+read_range(_,_,_,_) ->
+	exit(nif_library_not_loaded).
+decode(_,_) ->
+	exit(nif_library_not_loaded).
+find_evnum(_,_,_,_) ->
+	exit(nif_library_not_loaded).
+segment_evnums(_,_) ->
+	exit(nif_library_not_loaded).
+seek_time(_,_) ->
+	exit(nif_library_not_loaded).
 
 init(Info) ->
 	Schedulers = erlang:system_info(schedulers),
@@ -3,6 +3,9 @@
 -define(CFG,#{wthreads => 3, startindex => {1}, paths => {"./"}, pwrite => 0}).
 -define(INIT,init()).
 -define(LOAD_TEST_COMPR,false).
+% MB staged per integrity mode in bench_integrity
+-define(BENCH_MB,64).
+-export([init/0, bench_integrity/0]).
 
 init() ->
 	C = ?CFG,
@@ -19,16 +22,50 @@ init() ->
 
 run_test_() ->
 	erlang:system_flag(schedulers_online,4),
-	?INIT,
 	% [file:delete(Fn) || Fn <- ["1"]],
 	[file:delete(Fn) || Fn <- filelib:wildcard("*index*")],
+	crash_journal(),
+	?INIT,
 	[
-	fun dowrite/0
+	fun recovered/0,
+	fun dowrite/0,
+	fun dowrite_batch/0,
+	fun verify/0,
+	fun large_raw/0,
+	fun retention/0,
+	fun evnums/0,
+	fun hwm_subscribe/0,
+	{timeout,60,fun striping/0},
+	{timeout,60,fun mmap_writes/0},
+	{timeout,60,fun retire/0},
+	{timeout,60,fun rings/0},
+	{timeout,60,fun direct_writes/0},
+	{timeout,60,fun packed/0},
+	{timeout,60,fun lru_handles/0},
+	{timeout,60,fun iosched/0}
 	% fun cleanup/0
 	% {timeout,50,fun async/0}
 	].
 
 
+% Journal of segment 0 left by a crash before its index was created.
+% Evnum 7 is rewound, last entry is torn.
+crash_journal() ->
+	Q = <<"jactor">>,
+	Repl = fun(Pos, Evterm, Evnum) ->
+		<<(byte_size(Q)):16/little, 1, Q/binary, Pos:32/little, Evterm:64/little, Evnum:64/little>>
+	end,
+	ok = file:write_file("0.ijournal", [Repl(128, 3, 5), Repl(256, 3, 6), Repl(384, 4, 7),
+		<<(byte_size(Q)):16/little, 2, Q/binary, 7:64/little>>,
+		<<(byte_size(Q)):16/little, 1, "jac">>]).
+
+% Init indexed segment 0 from its journal, it is below startindex.
+recovered() ->
+	false = filelib:is_file("0.ijournal"),
+	true = filelib:is_file("0.index"),
+	{ok,[{3,6,256}]} = aqdrv:find_evnum(0, 0, <<"jactor">>, 5),
+	{ok,5,6} = aqdrv:segment_evnums(0, 0).
+
 dowrite() ->
 	application:ensure_all_started(crypto),
 	C = aqdrv:open(1,true),
@@ -51,6 +88,19 @@ dowrite() ->
 	WPos1 = aqdrv:write(C, [<<"WILL BE IGNORED">>], Header),
 	?debugFmt("Wpos ~p",[WPos1]),
 	ok = aqdrv:index_events(C,[<<"test2">>],<<0,"1">>,1,2),
+	ok = aqdrv:stage_map(C, <<"ITEM3">>, 12, byte_size(Body2)),
+	ok = aqdrv:stage_data(C, Body2),
+	_ = aqdrv:stage_flush(C),
+	_ = aqdrv:write(C, [<<"WILL BE IGNORED">>], Header),
+	ok = aqdrv:index_events_batch([{C,[<<"test3">>],<<0,"1">>,1,3}]),
+	% Same connection twice in a batch is rejected, nothing is indexed.
+	ok = aqdrv:stage_map(C, <<"ITEM4">>, 12, byte_size(Body2)),
+	ok = aqdrv:stage_data(C, Body2),
+	_ = aqdrv:stage_flush(C),
+	_ = aqdrv:write(C, [<<"WILL BE IGNORED">>], Header),
+	{'EXIT',{{badmatch,false},_}} = (catch aqdrv:index_events_batch([
+		{C,[<<"test4">>],<<0,"1">>,1,4},{C,[<<"test4">>],<<0,"1">>,1,4}])),
+	ok = aqdrv:index_events_batch([{C,[<<"test4">>],<<0,"1">>,1,4}]),
 
 	{ok,F} = file:open("1.q",[read,binary,raw]),
 	{ok,Bin} = file:read(F,1024),
@@ -60,6 +110,389 @@ dowrite() ->
 	  _/binary>> = Bin,
 	file:close(F).
 
+dowrite_batch() ->
+	C = aqdrv:open(2,true),
+	Header = [<<"BATCH_HEADER">>],
+	Events = [{<<"BITEM1">>, 1, crypto:rand_bytes(100*1024)},
+		{<<"BITEM2">>, 2, <<"SMALL">>},
+		{<<"BITEM3">>, 3, crypto:rand_bytes(300*1024)}],
+	{WPos,_Size,_} = aqdrv:write_batch(C, Events, [<<"WILL BE IGNORED">>], Header, {<<0,"2">>,1,1}),
+	?debugFmt("Batch wpos ~p",[WPos]),
+	{ok,F} = file:open("1.q",[read,binary,raw]),
+	{ok,Bin} = file:pread(F,WPos,1024),
+	<<(16#184D2A50):32/unsigned-little, 12:32/unsigned-little, "BATCH_HEADER",
+	  (16#184D2A50):32/unsigned-little,_:32,_,6,"BITEM1",1,(100*1024):32,0:32,
+	  _,6,"BITEM2",2,5:32,(100*1024):32,
+	  _,6,"BITEM3",3,(300*1024):32,(100*1024+5):32,
+	  _/binary>> = Bin,
+	file:close(F).
+
+verify() ->
+	{ok,NRecs,EndPos} = aqdrv:verify_segment(0, 1, 4),
+	?debugFmt("Verified ~p records, end ~p",[NRecs, EndPos]),
+	true = NRecs >= 3,
+	{ok,1,0} = aqdrv:seek_time(0, 0),
+	{ok,1,_} = aqdrv:seek_time(0, erlang:system_time(millisecond)),
+	{ok,Recs,Next} = aqdrv:read_range(0, 1, 0, 64*1024*1024),
+	NRecs = length(Recs),
+	true = Next >= EndPos,
+	[<<(16#184D2A50):32/unsigned-little,_/binary>> = R || R <- Recs],
+	{ok,<<"HEADER_PART1","HEADER_PART2">>,[{<<"ITEM1">>,12,<<"DATA SECTION START",_/binary>>}]} = 
+		aqdrv:decode(hd(Recs)),
+	{ok,_,[{<<"ITEM2">>,12,<<"AAABBBBCCCCDDDDEEEEFFFFF">>}]} = aqdrv:decode(lists:nth(2,Recs),[<<"ITEM2">>]),
+	{ok,<<"BATCH_HEADER">>,[{<<"BITEM2">>,2,<<"SMALL">>}]} = aqdrv:decode(lists:last(Recs),[<<"BITEM2">>]),
+	% Flip a byte inside first record header
+	{ok,F} = file:open("1.q",[read,write,binary,raw]),
+	{ok,<<B>>} = file:pread(F,10,1),
+	ok = file:pwrite(F,10,<<(B bxor 1)>>),
+	{error,{corrupt,0}} = aqdrv:verify_segment(0, 1, 4),
+	ok = file:pwrite(F,10,<<B>>),
+	file:close(F).
+
+% Large uncompressed events are hashed for record checksum on a dirty scheduler.
+large_raw() ->
+	C = aqdrv:open(5,false),
+	Big = crypto:rand_bytes(1024*1024),
+	{WPos,_,_} = write_rec(C, Big),
+	{_,_,_} = aqdrv:write_batch(C, [{<<"B1">>,1,Big},{<<"B2">>,2,<<"SMALL">>}],
+		[<<"R">>], [<<"RAW_BATCH">>], undefined),
+	{ok,_,_} = aqdrv:verify_segment(0, 1, 4),
+	{ok,[Rec|_],_} = aqdrv:read_range(0, 1, WPos, 1),
+	{ok,_,[{<<"REC">>,1,Big}]} = aqdrv:decode(Rec).
+
+% Segment being written is never retired, whatever the policy.
+retention() ->
+	{error,_} = aqdrv:set_retention(0, #{maxbytes => -1}),
+	false = aqdrv:set_retention(5, #{maxage => 1}),
+	ok = aqdrv:set_retention(0, #{maxbytes => 1, maxage => 0, minindex => 100}),
+	timer:sleep(200),
+	true = filelib:is_file("1.q"),
+	{ok,[_|_],_} = aqdrv:read_range(0, 1, 0, 1024),
+	ok = aqdrv:set_retention(0, #{maxbytes => 0, maxage => 0, minindex => -1}).
+
+% Unsafe subscriber hears about a write past its offset, nothing once unsubscribed.
+hwm_subscribe() ->
+	C = aqdrv:open(4,true),
+	ok = aqdrv:subscribe(0, 1, 0, self(), unsafe),
+	{WPos,_,_} = hwm_write(C),
+	receive
+		{aqdrv_hwm,0,_,Pos} when Pos > WPos ->
+			ok
+	after 2000 ->
+		throw(no_hwm)
+	end,
+	ok = aqdrv:unsubscribe(0, self()),
+	hwm_flush(),
+	_ = hwm_write(C),
+	receive
+		{aqdrv_hwm,_,_,_} = Msg ->
+			throw({unsubscribed,Msg})
+	after 300 ->
+		ok
+	end.
+hwm_write(C) ->
+	Body = <<"HWM">>,
+	ok = aqdrv:stage_map(C, <<"HWM">>, 1, byte_size(Body)),
+	ok = aqdrv:stage_data(C, Body),
+	_ = aqdrv:stage_flush(C),
+	aqdrv:write(C, [<<"R">>], [<<"HWM_HEADER">>]).
+hwm_flush() ->
+	receive
+		{aqdrv_hwm,_,_,_} ->
+			hwm_flush()
+	after 0 ->
+		ok
+	end.
+
+% Lookups in evnum db of replayed segment 0. Segment 1 is still written.
+evnums() ->
+	Q = <<"jactor">>,
+	{ok,[{3,5,128},{3,6,256}]} = aqdrv:find_evnum(0, 0, Q, 0),
+	{ok,[]} = aqdrv:find_evnum(0, 0, Q, 6),
+	{ok,[]} = aqdrv:find_evnum(0, 0, <<"jacto">>, 0),
+	{ok,[]} = aqdrv:find_evnum(0, 0, <<"jactor2">>, 0),
+	{error,"not indexed"} = aqdrv:find_evnum(0, 1, <<0,"1">>, 0),
+	{error,"not indexed"} = aqdrv:segment_evnums(0, 1),
+	{error,"no segment"} = aqdrv:segment_evnums(0, 1000),
+	{'EXIT',{badarg,_}} = (catch aqdrv:find_evnum(0, 0, <<>>, 0)),
+	{'EXIT',{badarg,_}} = (catch aqdrv:segment_evnums(5, 0)).
+
+% Queue is initialized once per node. Tests that need other init options run
+% Fun on a new node, every path of Cfg is an empty directory.
+node_test(Name, #{paths := Paths} = Cfg, Fun) ->
+	case node() of
+		nonode@nohost ->
+			{ok,_} = net_kernel:start([aqdrv_test, shortnames]);
+		_ ->
+			ok
+	end,
+	[begin
+		ok = filelib:ensure_dir(P),
+		[file:delete(Fn) || Fn <- filelib:wildcard(P++"*")]
+	end || P <- tuple_to_list(Paths)],
+	[_,Host] = string:tokens(atom_to_list(node()),"@"),
+	{ok,Node} = slave:start_link(list_to_atom(Host), Name,
+		"-pa "++string:join(code:get_path()," -pa ")),
+	try
+		Recycle = list_to_tuple([{} || _ <- tuple_to_list(Paths)]),
+		ok = rpc:call(Node, aqdrv, init, [Cfg#{recycle => Recycle}]),
+		ok = rpc:call(Node, erlang, apply, [Fun, []])
+	after
+		slave:stop(Node)
+	end.
+
+write_rec(C, Body) ->
+	ok = aqdrv:stage_map(C, <<"REC">>, 1, byte_size(Body)),
+	ok = aqdrv:stage_data(C, Body),
+	_ = aqdrv:stage_flush(C),
+	aqdrv:write(C, [<<"R">>], [<<"REC_HEADER">>]).
+
+% Striped writes are answered with path and seq, seq grows whatever path write
+% lands on. fsync covers every path connection wrote to.
+striping() ->
+	node_test(aqdrv_stripe, #{wthreads => 2, startindex => {1,1},
+		paths => {"stripe0/","stripe1/"}, striping => 1}, fun striping1/0).
+striping1() ->
+	application:ensure_all_started(crypto),
+	Self = self(),
+	Pids = [spawn_link(fun() -> Self ! {self(), stripe_writer(H)} end) || H <- lists:seq(1,4)],
+	200 = lists:sum([receive {Pid,N} -> N end || Pid <- Pids]),
+	{ok,N0,_} = aqdrv:verify_segment(0, 1, 1),
+	{ok,N1,_} = aqdrv:verify_segment(1, 1, 1),
+	200 = N0+N1,
+	ok.
+stripe_writer(H) ->
+	C = aqdrv:open(H,true),
+	Res = [write_rec(C, crypto:rand_bytes(1000+N)) || N <- lists:seq(1,50)],
+	Seqs = lists:seq(1,50),
+	Seqs = [Seq || {_,_,_,_,Seq} <- Res],
+	[true = Path == 0 orelse Path == 1 || {_,_,_,Path,_} <- Res],
+	ok = aqdrv:fsync(C),
+	length(Res).
+
+% Records written through segment mapping, over several 1MB segments.
+mmap_writes() ->
+	node_test(aqdrv_mmap, #{wthreads => 2, startindex => {1}, paths => {"mmap/"},
+		wmode => mmap, prefault => 1, filelimit => 1024*1024}, fun mmap_writes1/0).
+mmap_writes1() ->
+	application:ensure_all_started(crypto),
+	C = aqdrv:open(1,true),
+	[{_,_,_} = write_rec(C, crypto:rand_bytes(20000)) || _ <- lists:seq(1,120)],
+	{ok,[Rec|_],_} = aqdrv:read_range(0, 1, 0, 1),
+	{ok,_,[{<<"REC">>,1,_}]} = aqdrv:decode(Rec),
+	ok = aqdrv:inject(C, Rec),
+	ok = aqdrv:fsync(C),
+	Counts = [begin {ok,N,_} = aqdrv:verify_segment(0, I, 2), N end || I <- [1,2,3]],
+	121 = lists:sum(Counts),
+	ok.
+
+% O_DIRECT writes, every record padded to dalign. Records must read back
+% through read_range and inject, over a segment switch.
+direct_writes() ->
+	node_test(aqdrv_direct, #{wthreads => 1, startindex => {1}, paths => {"direct/"},
+		wmode => direct, filelimit => 1024*1024}, fun direct_writes1/0).
+direct_writes1() ->
+	application:ensure_all_started(crypto),
+	C = aqdrv:open(1,true),
+	Bodies = [crypto:rand_bytes(20000+N) || N <- lists:seq(1,60)],
+	[{_,_,_} = write_rec(C, B) || B <- Bodies],
+	{ok,[Rec|_] = Recs,_} = aqdrv:read_range(0, 1, 0, 1024*1024),
+	Read = lists:zip(Recs, lists:sublist(Bodies, length(Recs))),
+	[{ok,_,[{<<"REC">>,1,B}]} = aqdrv:decode(R) || {R,B} <- Read],
+	ok = aqdrv:inject(C, Rec),
+	ok = aqdrv:fsync(C),
+	Counts = [begin {ok,N,_} = aqdrv:verify_segment(0, I, 2), N end || I <- [1,2]],
+	61 = lists:sum(Counts),
+	ok.
+
+% Packed segments, records on 8 byte boundaries prefixed with 4 byte LE length.
+% Odd sized records roll over 1MB segments and must all read back in order.
+packed() ->
+	node_test(aqdrv_packed, #{wthreads => 1, startindex => {1}, paths => {"packed/"},
+		align => 8, filelimit => 1024*1024}, fun packed1/0).
+packed1() ->
+	application:ensure_all_started(crypto),
+	C = aqdrv:open(1,true),
+	Bodies = [crypto:rand_bytes(20000+N) || N <- lists:seq(1,120)],
+	[{_,_,_} = write_rec(C, B) || B <- Bodies],
+	ok = aqdrv:fsync(C),
+	Counts = [begin {ok,N,_} = aqdrv:verify_segment(0, I, 2), N end || I <- [1,2,3]],
+	120 = lists:sum(Counts),
+	true = lists:all(fun(N) -> N > 0 end, Counts),
+	Recs = lists:append([begin {ok,R,_} = aqdrv:read_range(0, I, 0, 2*1024*1024), R end || I <- [1,2,3]]),
+	120 = length(Recs),
+	[{ok,_,[{<<"REC">>,1,B}]} = aqdrv:decode(R) || {R,B} <- lists:zip(Recs, Bodies)],
+
+	% Length prefix of first two records in file.
+	[R1,R2|_] = Recs,
+	{ok,F} = file:open("packed/1.q",[read,binary,raw]),
+	{ok,<<L1:32/unsigned-little>>} = file:pread(F, 0, 4),
+	L1 = byte_size(R1),
+	{ok,R1} = file:pread(F, 4, L1),
+	Next = (4+L1+7) band (bnot 7),
+	{ok,<<L2:32/unsigned-little>>} = file:pread(F, Next, 4),
+	L2 = byte_size(R2),
+	ok = file:close(F).
+
+wait_until(F) ->
+	wait_until(F, 100).
+wait_until(_, 0) ->
+	timeout;
+wait_until(F, N) ->
+	case F() of
+		true ->
+			ok;
+		false ->
+			timer:sleep(50),
+			wait_until(F, N-1)
+	end.
+
+% Rings of 2 fill up with many writers on few schedulers. Write must then wait
+% for writer thread to drain the ring and still complete, in order per connection.
+rings() ->
+	node_test(aqdrv_rings, #{wthreads => 1, startindex => {1}, paths => {"rings/"},
+		rings => 2}, fun rings1/0).
+rings1() ->
+	application:ensure_all_started(crypto),
+	erlang:trace_pattern({aqdrv,backoff,2}, true, [call_count]),
+	Self = self(),
+	Pids = [spawn_link(fun() -> Self ! {self(), ring_writer(H)} end) || H <- lists:seq(1,16)],
+	800 = lists:sum([receive {Pid,N} -> N end || Pid <- Pids]),
+	{call_count,Waits} = erlang:trace_info({aqdrv,backoff,2}, call_count),
+	true = Waits > 0,
+	{ok,800,_} = aqdrv:verify_segment(0, 1, 1),
+	ok.
+ring_writer(H) ->
+	C = aqdrv:open(H,true),
+	Res = [write_rec(C, crypto:rand_bytes(10000)) || _ <- lists:seq(1,50)],
+	[{_,_,_} = R || R <- Res],
+	ok = aqdrv:fsync(C),
+	length(Res).
+
+% Sealed and indexed segments are retired by policy. Retired .q is renamed to
+% .r and goes to recycle list, a segment with live read_range binaries is kept.
+% One writer, an idle one would hold the first segment open.
+retire() ->
+	node_test(aqdrv_retire, #{wthreads => 1, startindex => {1}, paths => {"retire/"},
+		filelimit => 1024*1024}, fun retire1/0).
+retire1() ->
+	application:ensure_all_started(crypto),
+	C = aqdrv:open(1,true),
+	{_,_,_} = write_rec(C, crypto:rand_bytes(20000)),
+	ok = aqdrv:index_events(C, [<<"ev1">>], <<"ractor">>, 1, 1),
+	[{_,_,_} = write_rec(C, crypto:rand_bytes(20000)) || _ <- lists:seq(1,150)],
+	ok = wait_until(fun() -> filelib:is_file("retire/2.index") end),
+	true = filelib:is_file("retire/1.index"),
+	Self = self(),
+	Pin = spawn_link(fun() -> pin_segment(2, Self) end),
+	receive {pinned,Pin} -> ok end,
+
+	ok = aqdrv:set_retention(0, #{maxbytes => 0, maxage => 0, minindex => 3}),
+	ok = wait_until(fun() -> not filelib:is_file("retire/1.q") end),
+	false = filelib:is_file("retire/1.index"),
+	false = filelib:is_file("retire/1.ijournal"),
+	true = filelib:is_file("retire/1.r"),
+	timer:sleep(300),
+	true = filelib:is_file("retire/2.q"),
+	Pin ! {check, self()},
+	receive {checked,Pin} -> ok end,
+
+	% Once binaries are gone, size policy retires it.
+	Pin ! release,
+	ok = aqdrv:set_retention(0, #{maxbytes => 1, maxage => 0, minindex => -1}),
+	ok = wait_until(fun() -> not filelib:is_file("retire/2.q") end),
+	false = filelib:is_file("retire/2.index"),
+	ok.
+pin_segment(LogIndex, Parent) ->
+	{ok,Recs,_} = aqdrv:read_range(0, LogIndex, 0, 64*1024),
+	Parent ! {pinned, self()},
+	receive
+		{check, From} ->
+			[{ok,_,[{<<"REC">>,1,_}]} = aqdrv:decode(R) || R <- Recs],
+			From ! {checked, self()}
+	end,
+	receive
+		release ->
+			ok
+	end.
+
+% With handles => 0 sealed segments are closed right away. read_range has to
+% reopen them, and eviction must not unmap a segment while its binaries live.
+lru_handles() ->
+	node_test(aqdrv_lru, #{wthreads => 1, startindex => {1}, paths => {"lru/"},
+		filelimit => 1024*1024, handles => 0}, fun lru_handles1/0).
+lru_handles1() ->
+	application:ensure_all_started(crypto),
+	C = aqdrv:open(1,true),
+	Bodies = [crypto:rand_bytes(20000+N) || N <- lists:seq(1,160)],
+	[{_,_,_} = write_rec(C, B) || B <- Bodies],
+	ok = aqdrv:fsync(C),
+	ok = wait_until(fun() -> sealed(1) andalso sealed(2) end),
+
+	% Opening segment 2 evicts, binaries of 1 are still used after that.
+	Self = self(),
+	Pin = spawn_link(fun() -> pin_segment(1, Self) end),
+	Mon = erlang:monitor(process, Pin),
+	receive {pinned,Pin} -> ok end,
+	{ok,Recs2,_} = aqdrv:read_range(0, 2, 0, 2*1024*1024),
+	Pin ! {check, self()},
+	receive {checked,Pin} -> ok end,
+	Pin ! release,
+	receive {'DOWN',Mon,_,_,_} -> ok end,
+
+	% Nothing holds 1 now, it is closed by next acquire and reopened after.
+	{ok,_,_} = aqdrv:read_range(0, 2, 0, 1),
+	Data = segment_data(aqdrv:read_range(0, 1, 0, 2*1024*1024)) ++ segment_data({ok,Recs2,0}),
+	true = length(Data) > 0 andalso lists:prefix(Data, Bodies),
+	ok.
+sealed(LogIndex) ->
+	{ok,_,End} = aqdrv:read_range(0, LogIndex, 0, 2*1024*1024),
+	element(1, aqdrv:read_range(0, LogIndex, End, 1)) == eof.
+segment_data({ok,Recs,_}) ->
+	[begin {ok,_,[{<<"REC">>,1,B}]} = aqdrv:decode(R), B end || R <- Recs].
+
+% 3MB of writes at 4MB/s with 1MB bucket. Writes are throttled but complete,
+% indexing and retirement wait for tokens and still happen once writes stop.
+iosched() ->
+	node_test(aqdrv_iosched, #{wthreads => 1, startindex => {1}, paths => {"iosched/"},
+		filelimit => 1024*1024, iorate => 4*1024*1024, iops => 400}, fun iosched1/0).
+iosched1() ->
+	application:ensure_all_started(crypto),
+	C = aqdrv:open(1,true),
+	{T,_} = timer:tc(fun() ->
+		[{_,_,_} = write_rec(C, crypto:rand_bytes(20000)) || _ <- lists:seq(1,150)],
+		ok = aqdrv:fsync(C)
+	end),
+	true = T > 300000,
+	ok = wait_until(fun() -> filelib:is_file("iosched/2.index") end),
+	ok = aqdrv:set_retention(0, #{maxbytes => 0, maxage => 0, minindex => 2}),
+	ok = wait_until(fun() -> not filelib:is_file("iosched/1.q") end),
+	true = filelib:is_file("iosched/2.q"),
+	ok.
+
+% Staging CPU per MB for every integrity mode. Not part of run_test_.
+% Needs an initialized queue: test:init(), test:bench_integrity().
+% Only stage_map/stage_data/stage_flush are timed, write is not.
+bench_integrity() ->
+	application:ensure_all_started(crypto),
+	Bin = binary:copy(<<"compressible event data ",(crypto:rand_bytes(8))/binary>>, 32*1024),
+	[begin
+		C = aqdrv:open(3, true, Mode),
+		Time = bench_stage(C, Bin, ?BENCH_MB, 0),
+		io:format("~p: ~pus/MB~n",[Mode, Time div ?BENCH_MB])
+	end || Mode <- [lz4, record, none]],
+	ok.
+bench_stage(_, _, 0, Time) ->
+	Time;
+bench_stage(C, Bin, N, Time) ->
+	{T,_} = timer:tc(fun() ->
+		ok = aqdrv:stage_map(C, <<"BENCH">>, 1, byte_size(Bin)),
+		ok = aqdrv:stage_data(C, Bin),
+		aqdrv:stage_flush(C)
+	end),
+	{_,_,_} = aqdrv:write(C, [<<"R">>], [<<"BENCH_HEADER">>]),
+	bench_stage(C, Bin, N-1, Time+T).
+
 % cleanup() ->
 % 	?debugFmt("Cleanup",[]),
 % 	garbage_collect(),